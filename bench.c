@@ -0,0 +1,475 @@
+// Throughput and latency benchmarks for my_malloc next to the system malloc.
+//
+//   make bench && ./bench [workload...]
+//
+// Every workload runs once per allocator, each time in a fresh child process
+// so peak RSS is measured in isolation. Latencies are sampled every
+// SAMPLE_EVERY calls and include the cost of reading the clock (~20ns).
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+
+#define SAMPLE_EVERY 16
+#define MAX_THREADS 8
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct Allocator {
+  const char* name;
+  void* (*malloc)(size_t size);
+  void (*free)(void* ptr);
+  void* (*realloc)(void* ptr, size_t size);
+} Allocator;
+
+// Per-thread counters and latency samples. The samples live in their own
+// mapping so neither allocator pays for the other's bookkeeping.
+typedef struct Recorder {
+  long ops;
+  long count;
+  uint32_t* samples;
+  unsigned int random_state;
+} Recorder;
+
+typedef struct Workload {
+  const char* name;
+  const char* description;
+  int threads;
+  void* (*run)(void* arg);
+  // Turn on MY_M_NUMA_ARENAS for my_malloc
+  int numa;
+} Workload;
+
+Allocator allocators[] = {
+    {"my_malloc", my_malloc, my_free, my_realloc},
+    {"system", malloc, free, realloc},
+};
+
+// The allocator under test in this process
+Allocator* alloc;
+Recorder recorders[MAX_THREADS];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+unsigned int next_random(Recorder* rec) {
+  rec->random_state = rec->random_state * 1103515245 + 12345;
+  return rec->random_state >> 8;
+}
+
+// Sizes spread evenly over the powers of two from 16 bytes up to
+// 1 << max_shift, the last power of two included: below 2 << max_shift.
+size_t random_size(Recorder* rec, int max_shift) {
+  int shift = 4 + next_random(rec) % (max_shift - 3);
+  size_t size = (size_t)1 << shift;
+  return size + next_random(rec) % size;
+}
+
+void record(Recorder* rec, long start) {
+  if (rec->count < MAX_SAMPLES)
+    rec->samples[rec->count++] = (uint32_t)(now_ns() - start);
+}
+
+void* timed_malloc(Recorder* rec, size_t size) {
+  void* ptr;
+
+  if (rec->ops++ % SAMPLE_EVERY != 0) {
+    ptr = alloc->malloc(size);
+  } else {
+    long start = now_ns();
+    ptr = alloc->malloc(size);
+    record(rec, start);
+  }
+
+  // Touch the memory like a real program would
+  *(char*)ptr = 1;
+  return ptr;
+}
+
+void timed_free(Recorder* rec, void* ptr) {
+  if (rec->ops++ % SAMPLE_EVERY != 0) {
+    alloc->free(ptr);
+  } else {
+    long start = now_ns();
+    alloc->free(ptr);
+    record(rec, start);
+  }
+}
+
+void* timed_realloc(Recorder* rec, void* ptr, size_t size) {
+  void* new_ptr;
+
+  if (rec->ops++ % SAMPLE_EVERY != 0) {
+    new_ptr = alloc->realloc(ptr, size);
+  } else {
+    long start = now_ns();
+    new_ptr = alloc->realloc(ptr, size);
+    record(rec, start);
+  }
+
+  ((char*)new_ptr)[size - 1] = 1;
+  return new_ptr;
+}
+
+// Fixed-size small objects replaced at random, like nodes of a busy linked
+// structure.
+#define SMALL_SLOTS 10000
+#define SMALL_OPS 4000000
+
+void* run_small_churn(void* arg) {
+  Recorder* rec = arg;
+  void** slots = calloc(SMALL_SLOTS, sizeof(void*));
+  long i;
+
+  for (i = 0; i < SMALL_OPS / 2; i++) {
+    int slot = next_random(rec) % SMALL_SLOTS;
+    if (slots[slot] != NULL) timed_free(rec, slots[slot]);
+    slots[slot] = timed_malloc(rec, 32);
+  }
+
+  for (i = 0; i < SMALL_SLOTS; i++)
+    if (slots[i] != NULL) alloc->free(slots[i]);
+  free(slots);
+  return NULL;
+}
+
+// Mixed sizes from 16 bytes to 64KB allocated and freed at random, which
+// keeps the heap fragmented.
+#define RANDOM_SLOTS 20000
+#define RANDOM_OPS 2000000
+
+void* run_random_churn(void* arg) {
+  Recorder* rec = arg;
+  void** slots = calloc(RANDOM_SLOTS, sizeof(void*));
+  long i;
+
+  for (i = 0; i < RANDOM_OPS; i++) {
+    int slot = next_random(rec) % RANDOM_SLOTS;
+    if (slots[slot] == NULL) {
+      slots[slot] = timed_malloc(rec, random_size(rec, 15));
+    } else {
+      timed_free(rec, slots[slot]);
+      slots[slot] = NULL;
+    }
+  }
+
+  for (i = 0; i < RANDOM_SLOTS; i++)
+    if (slots[i] != NULL) alloc->free(slots[i]);
+  free(slots);
+  return NULL;
+}
+
+// Buffers growing side by side by a quarter at a time, like strings or
+// vectors being appended to.
+#define GROWTH_BUFFERS 64
+#define GROWTH_ROUNDS 200
+#define GROWTH_MAX (256 * 1024)
+
+void* run_realloc_growth(void* arg) {
+  Recorder* rec = arg;
+  void* buffers[GROWTH_BUFFERS];
+  int round, i;
+
+  for (round = 0; round < GROWTH_ROUNDS; round++) {
+    size_t size;
+
+    memset(buffers, 0, sizeof(buffers));
+    for (size = 16; size <= GROWTH_MAX; size += size / 4)
+      for (i = 0; i < GROWTH_BUFFERS; i++)
+        buffers[i] = timed_realloc(rec, buffers[i], size);
+
+    for (i = 0; i < GROWTH_BUFFERS; i++) timed_free(rec, buffers[i]);
+  }
+  return NULL;
+}
+
+// Larson-style server simulation: every thread replaces objects at random in
+// its own array, and after every epoch the arrays move on to the next
+// thread, so most objects are freed by a thread other than the one that
+// allocated them.
+#define LARSON_THREADS 4
+#define LARSON_SLOTS 1000
+#define LARSON_EPOCHS 20
+#define LARSON_OPS 50000
+
+void** larson_arrays[LARSON_THREADS];
+pthread_barrier_t larson_barrier;
+
+void* run_larson(void* arg) {
+  Recorder* rec = arg;
+  int id = rec - recorders;
+  int epoch, i;
+
+  larson_arrays[id] = calloc(LARSON_SLOTS, sizeof(void*));
+  pthread_barrier_wait(&larson_barrier);
+
+  for (epoch = 0; epoch < LARSON_EPOCHS; epoch++) {
+    void** slots = larson_arrays[(id + epoch) % LARSON_THREADS];
+
+    for (i = 0; i < LARSON_OPS; i++) {
+      int slot = next_random(rec) % LARSON_SLOTS;
+      if (slots[slot] != NULL) timed_free(rec, slots[slot]);
+      slots[slot] = timed_malloc(rec, random_size(rec, 7));
+    }
+    pthread_barrier_wait(&larson_barrier);
+  }
+
+  for (i = 0; i < LARSON_SLOTS; i++)
+    if (larson_arrays[id][i] != NULL) alloc->free(larson_arrays[id][i]);
+  free(larson_arrays[id]);
+  return NULL;
+}
+
+// Producers allocate batches of objects and hand them to a consumer thread
+// that frees them, so every free is a cross-thread free.
+#define PAIRS 2
+#define BATCH 64
+#define QUEUE_DEPTH 16
+#define PRODUCER_BATCHES 20000
+
+typedef struct Queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  void* batches[QUEUE_DEPTH][BATCH];
+  long head;
+  long tail;
+} Queue;
+
+Queue queues[PAIRS];
+
+void* run_producer_consumer(void* arg) {
+  Recorder* rec = arg;
+  int id = rec - recorders;
+  Queue* queue = &queues[id / 2];
+  int is_producer = id % 2 == 0;
+  long batch;
+  int i;
+
+  for (batch = 0; batch < PRODUCER_BATCHES; batch++) {
+    void* items[BATCH];
+
+    if (is_producer) {
+      for (i = 0; i < BATCH; i++)
+        items[i] = timed_malloc(rec, random_size(rec, 10));
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if (is_producer) {
+      while (queue->tail - queue->head == QUEUE_DEPTH)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+      memcpy(queue->batches[queue->tail++ % QUEUE_DEPTH], items,
+             sizeof(items));
+    } else {
+      while (queue->tail == queue->head)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+      memcpy(items, queue->batches[queue->head++ % QUEUE_DEPTH],
+             sizeof(items));
+    }
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!is_producer) {
+      for (i = 0; i < BATCH; i++) timed_free(rec, items[i]);
+    }
+  }
+  return NULL;
+}
+
+// Like larson, but the threads alternate between two NUMA nodes, so every
+// epoch the arrays cross to the other node, and each thread reads through
+// its objects the way a real program would. Without node-local arenas the
+// objects a thread allocates come from memory its node has to reach across
+// the interconnect. On a machine with a single node every thread is pinned
+// to that node and the workload measures only the extra bookkeeping.
+#define CROSS_THREADS 4
+#define CROSS_SLOTS 4096
+#define CROSS_EPOCHS 20
+#define CROSS_OPS 20000
+#define CROSS_READS 4
+
+void** cross_arrays[CROSS_THREADS];
+size_t* cross_sizes[CROSS_THREADS];
+
+// Finds the first CPU of a node from sysfs, or -1 if the node is missing.
+int first_cpu_of_node(int node) {
+  char path[64], text[16];
+  int cpu = -1;
+  int fd;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (read(fd, text, sizeof(text) - 1) > 0) cpu = atoi(text);
+  close(fd);
+  return cpu;
+}
+
+void pin_to_node(int node) {
+  int cpu = first_cpu_of_node(node);
+  cpu_set_t set;
+
+  if (cpu < 0) cpu = first_cpu_of_node(0);
+  if (cpu < 0) return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void* run_cross_node(void* arg) {
+  Recorder* rec = arg;
+  int id = rec - recorders;
+  int epoch, read, i;
+  long sum = 0;
+
+  // Pinned before the first allocation, which picks the thread's arena
+  pin_to_node(id % 2);
+  cross_arrays[id] = calloc(CROSS_SLOTS, sizeof(void*));
+  cross_sizes[id] = calloc(CROSS_SLOTS, sizeof(size_t));
+  pthread_barrier_wait(&larson_barrier);
+
+  for (epoch = 0; epoch < CROSS_EPOCHS; epoch++) {
+    int owner = (id + epoch) % CROSS_THREADS;
+    void** slots = cross_arrays[owner];
+    size_t* sizes = cross_sizes[owner];
+
+    for (i = 0; i < CROSS_OPS; i++) {
+      int slot = next_random(rec) % CROSS_SLOTS;
+      if (slots[slot] != NULL) timed_free(rec, slots[slot]);
+      sizes[slot] = random_size(rec, 12);
+      slots[slot] = timed_malloc(rec, sizes[slot]);
+      memset(slots[slot], epoch, sizes[slot]);
+    }
+    for (read = 0; read < CROSS_READS; read++)
+      for (i = 0; i < CROSS_SLOTS; i++)
+        if (slots[i] != NULL) sum += ((char*)slots[i])[sizes[i] / 2];
+    pthread_barrier_wait(&larson_barrier);
+  }
+
+  for (i = 0; i < CROSS_SLOTS; i++)
+    if (cross_arrays[id][i] != NULL) alloc->free(cross_arrays[id][i]);
+  free(cross_arrays[id]);
+  free(cross_sizes[id]);
+  return (void*)sum;
+}
+
+Workload workloads[] = {
+    {"small_churn", "32-byte objects replaced at random", 1,
+     run_small_churn},
+    {"random_churn", "16B-64KB objects allocated and freed at random", 1,
+     run_random_churn},
+    {"realloc_growth", "64 buffers grown side by side to 256KB", 1,
+     run_realloc_growth},
+    {"larson", "4 threads trading arrays of 16B-256B objects", LARSON_THREADS,
+     run_larson},
+    {"producer_consumer", "2 producers, 2 consumers freeing their objects",
+     2 * PAIRS, run_producer_consumer},
+    {"cross_node", "4 threads on 2 NUMA nodes trading 16B-8KB objects",
+     CROSS_THREADS, run_cross_node, 1},
+};
+
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+int compare_samples(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Runs one workload with the allocator under test and prints a result line.
+// Meant to run in a child process of its own.
+void run_workload(Workload* workload) {
+  pthread_t threads[MAX_THREADS];
+  long ops = 0;
+  long count = 0;
+  uint32_t* samples;
+  struct rusage usage;
+  int i;
+
+  for (i = 0; i < workload->threads; i++) {
+    recorders[i].samples =
+        mmap(NULL, MAX_SAMPLES * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recorders[i].random_state = i + 1;
+  }
+  pthread_barrier_init(&larson_barrier, NULL, workload->threads);
+  if (workload->numa && alloc->malloc == my_malloc)
+    my_mallopt(MY_M_NUMA_ARENAS, 1);
+  for (i = 0; i < PAIRS; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    pthread_cond_init(&queues[i].changed, NULL);
+  }
+
+  long start = now_ns();
+  for (i = 0; i < workload->threads; i++)
+    pthread_create(&threads[i], NULL, workload->run, &recorders[i]);
+  for (i = 0; i < workload->threads; i++) pthread_join(threads[i], NULL);
+  double seconds = (now_ns() - start) / 1e9;
+
+  // Gather every thread's samples behind the first thread's
+  samples = recorders[0].samples;
+  count = recorders[0].count;
+  for (i = 0; i < workload->threads; i++) {
+    ops += recorders[i].ops;
+    if (i > 0) {
+      long room = MAX_SAMPLES - count;
+      long take = recorders[i].count < room ? recorders[i].count : room;
+      memcpy(samples + count, recorders[i].samples, take * sizeof(uint32_t));
+      count += take;
+    }
+  }
+  qsort(samples, count, sizeof(uint32_t), compare_samples);
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%-18s %-10s %12.0f ops/s  p50 %6u ns  p99 %7u ns  p99.9 %7u ns"
+         "  peak RSS %8ld KB\n",
+         workload->name, alloc->name, ops / seconds, samples[count / 2],
+         samples[count * 99 / 100], samples[count * 999 / 1000],
+         usage.ru_maxrss);
+}
+
+int is_selected(const char* name, int argc, char** argv) {
+  int i;
+
+  if (argc < 2) return 1;
+  for (i = 1; i < argc; i++)
+    if (strcmp(argv[i], name) == 0) return 1;
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int i, j;
+
+  for (i = 0; i < NUM_WORKLOADS; i++) {
+    if (!is_selected(workloads[i].name, argc, argv)) continue;
+
+    printf("# %s: %s\n", workloads[i].name, workloads[i].description);
+    fflush(stdout);
+
+    for (j = 0; j < NUM_ALLOCATORS; j++) {
+      pid_t child = fork();
+      if (child == 0) {
+        alloc = &allocators[j];
+        run_workload(&workloads[i]);
+        fflush(stdout);
+        _exit(0);
+      }
+      waitpid(child, NULL, 0);
+    }
+  }
+  return 0;
+}
@@ -1,5 +1,10 @@
 // Joshua Sizer (jas625)
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "mymalloc.h"
@@ -26,6 +31,11 @@
 
 #define PTR_ADD_BYTES(ptr, byte_offs) ((void*)(((char*)(ptr)) + (byte_offs)))
 
+// Size of the allocator's block header on a 64-bit build. Data sizes are
+// rounded up so that header + data is a multiple of 16, with at least 24
+// bytes of data: 80 bytes becomes 88, 40 stays 40, 16 becomes 24.
+#define HEADER_SIZE 8
+
 void* start_test(const char* where) {
   printf(
       CYAN("-------------------------------------------------------------------"
@@ -94,8 +104,8 @@ void test_reuse() {
   my_free(a);
 
   // After that free, your heap should have two blocks:
-  // - A free 80-byte block at the beginning
-  // - Then a used 80-byte block as the heap tail
+  // - A free 88-byte block at the beginning
+  // - Then a used 88-byte block as the heap tail
 
   // So when we allocate another block of a *smaller* size,
   // it should reuse the first one:
@@ -106,29 +116,29 @@ void test_reuse() {
 
   // Here, if you DIDN'T implement splitting,
   // you will still have two blocks:
-  // - A used 80-byte block (NOT 40 bytes!) at the beginning
-  // - A used 80-byte block as the heap tail
+  // - A used 88-byte block (NOT 40 bytes!) at the beginning
+  // - A used 88-byte block as the heap tail
 
   // But if you DID implement splitting, you will have:
   // - A used 40-byte block at the beginning
-  // - A free *24-byte* block in the middle (assuming your block header is 16
+  // - A free *40-byte* block in the middle (assuming your block header is 8
   // bytes)
-  // - A used 80-byte block as the heap tail
+  // - A used 88-byte block as the heap tail
 
   my_free(c);
 
   // No matter what, here you will have two blocks:
-  // - A free 80-byte block at the beginning
-  // - A used 80-byte block as the heap tail
+  // - A free 88-byte block at the beginning
+  // - A used 88-byte block as the heap tail
 
   // If you have 2 free blocks instead of 1, your coalescing isn't working.
 
   my_free(b);
 
   // Finally, if you DIDN'T implement coalescing, you
-  // will still have one free 80-byte block on the heap,
+  // will still have one free 88-byte block on the heap,
   // and you'll get a message saying the heap grew
-  // by 80 + sizeof(header) bytes.
+  // by 88 + sizeof(header) bytes.
 
   // But if you DID implement coalescing, you will have
   // nothing left on the heap here!
@@ -156,8 +166,8 @@ void test_first_fit() {
   my_free(d);
   my_free(e);
 
-  // Should have 5 free blocks, separated by tiny (16B) used blocks, like so:
-  // [F 40][U 16][F 80][U 16][F 120][U 16][F 160][U 16][F 200][U 16]
+  // Should have 5 free blocks, separated by tiny (24B) used blocks, like so:
+  // [F 40][U 24][F 88][U 24][F 120][U 24][F 168][U 24][F 200][U 24]
 
   // Now if we try to malloc 30 ints, it should loop around to the beginning
   // and go until it finds the block that used to be 'c'.
@@ -168,7 +178,7 @@ void test_first_fit() {
     printf(RED("the 120-byte block was not reused.\n"));
   } else {
     // You correctly reused the block at 'c'. The heap should be like:
-    // [F 40][U 16][F 80][U 16][U 120][U 16][F 160][U 16][F 200][U 16]
+    // [F 40][U 24][F 88][U 24][U 120][U 24][F 168][U 24][F 200][U 24]
 
     // If we malloc 10 ints, first-fit should find that first block on the heap.
 
@@ -179,13 +189,13 @@ void test_first_fit() {
       my_free(should_be_a);
     } else {
       // You correctly reused the block at 'a'. The heap should be like:
-      // [U 40][U 16][F 80][U 16][U 120][U 16][F 160][U 16][F 200][U 16]
+      // [U 40][U 24][F 88][U 24][U 120][U 24][F 168][U 24][F 200][U 24]
       // and if we allocate a 10-int array... it should pick up b.
 
       int* should_be_b = make_array(10);
 
       if (should_be_b != b) {
-        printf(RED("the 80-byte block was not reused.\n"));
+        printf(RED("the 88-byte block was not reused.\n"));
 
         if (should_be_b > div5) {
           printf(RED("looks like you expanded the heap instead...\n"));
@@ -206,6 +216,51 @@ void test_first_fit() {
   check_heap_size("test_first_fit", heap_at_start);
 }
 
+// Large free blocks are searched best-fit: the smallest one that fits wins,
+// wherever it sits on the heap, and among equal sizes the lowest one does.
+void test_best_fit() {
+  void* heap_at_start = start_test("test_best_fit");
+
+  int* a = make_array(1000);
+  int* div1 = make_array(1);
+  int* b = make_array(500);
+  int* div2 = make_array(1);
+  int* c = make_array(750);
+  int* div3 = make_array(1);
+  int* d = make_array(500);
+  int* div4 = make_array(1);
+  my_free(a);
+  my_free(b);
+  my_free(c);
+  my_free(d);
+
+  // First-fit would take the 4000-byte block at the start of the heap, but
+  // the two 2000-byte ones fit better.
+  int* should_be_b = make_array(490);
+  int* should_be_d = make_array(490);
+
+#ifndef MYMALLOC_TLSF
+  // TLSF settles for a good fit, so it may take any of them
+  if (should_be_b != b)
+    printf(RED("the lowest of the best fitting blocks was not used.\n"));
+  if (should_be_d != d)
+    printf(RED("the other best fitting block was not used.\n"));
+#endif
+
+  // Only the 3000-byte block is left that holds this
+  int* should_be_c = make_array(700);
+  if (should_be_c != c) printf(RED("the 3000-byte block was not used.\n"));
+
+  my_free(should_be_b);
+  my_free(should_be_d);
+  my_free(should_be_c);
+  my_free(div1);
+  my_free(div2);
+  my_free(div3);
+  my_free(div4);
+  check_heap_size("test_best_fit", heap_at_start);
+}
+
 // Makes sure that your coalescing works.
 void test_coalescing() {
   void* heap_at_start = start_test("test_coalescing");
@@ -222,14 +277,14 @@ void test_coalescing() {
   // ones will test with a single previous free neighbor.
 
   // After each of these frees, you should have ONE
-  // free block of the given size (assuming your headers are 16 bytes):
+  // free block of the given size (assuming your headers are 8 bytes):
   my_free(a);  // 40B
-  my_free(b);  // 96B
-  my_free(c);  // 152B
-  my_free(d);  // 208B
+  my_free(b);  // 88B
+  my_free(c);  // 136B
+  my_free(d);  // 184B
 
-  // This should reuse a's block, since it's 208 bytes.
-  int* f = make_array(52);
+  // This should reuse a's block, since it's 184 bytes.
+  int* f = make_array(46);
 
   if (a != f) printf(RED("You didn't reuse the coalesced block!\n"));
 
@@ -254,8 +309,8 @@ void test_coalescing() {
   // After each you should have:
   my_free(b);  // one free 40B
   my_free(d);  // two free 40B
-  my_free(a);  // one free 96B, one free 40B
-  my_free(c);  // one free 208B
+  my_free(a);  // one free 88B, one free 40B
+  my_free(c);  // one free 184B
   my_free(e);  // nothing left!
 
   check_heap_size("part 2 of test_coalescing", heap_at_start);
@@ -271,9 +326,9 @@ void test_coalescing() {
 
   // After each you should have:
   my_free(b);  // one free 40B, four used 40B
-  my_free(a);  // one free 96B, three used 40B
-  my_free(d);  // one free 96B, one free 40B, two used 40B
-  my_free(e);  // one free 96B, one used 40B
+  my_free(a);  // one free 88B, three used 40B
+  my_free(d);  // one free 88B, one free 40B, two used 40B
+  my_free(e);  // one free 88B, one used 40B
   my_free(c);  // nothing left!
 
   check_heap_size("part 3 of test_coalescing", heap_at_start);
@@ -283,20 +338,20 @@ void test_coalescing() {
 void test_splitting() {
   void* heap_at_start = start_test("test_splitting");
 
-  int* medium = make_array(64);  // make a 256-byte block.
+  int* medium = make_array(64);  // make a 264-byte block.
   int* holder = make_array(4);   // holds the break back.
   my_free(medium);
 
-  // Now there should be a free 256-byte block.
+  // Now there should be a free 264-byte block.
 
   // THIS allocation SHOULD NOT split the block, since it's
   // too big (would leave a too-small block).
-  // It would want a 228 byte data portion, + 16 bytes for the header, would
-  // leave only 8 bytes for the free split block's data.
-  int* too_big = make_array(57);
+  // It would want a 248 byte data portion (236 rounded up), + 8 bytes for
+  // the header, would leave only 8 bytes for the free split block's data.
+  int* too_big = make_array(59);
 
   // Now you should have two blocks on the heap, but the first used one should
-  // still be 256 bytes, even though the user only asked for 228!
+  // still be 264 bytes, even though the user only asked for 236!
 
   my_free(too_big);
 
@@ -306,19 +361,19 @@ void test_splitting() {
 
   // After each, you should be left with a free block of the given
   // size:
-  int* tiny1 = make_array(4);  // 224B
-  int* tiny2 = make_array(4);  // 192B
-  int* tiny3 = make_array(4);  // 160B
-  int* tiny4 = make_array(4);  // 128B
+  int* tiny1 = make_array(4);  // 232B
+  int* tiny2 = make_array(4);  // 200B
+  int* tiny3 = make_array(4);  // 168B
+  int* tiny4 = make_array(4);  // 136B
 
   if (tiny1 != medium)
-    printf(RED("You didn't split the 256B block!\n"));
-  else if (tiny2 != PTR_ADD_BYTES(tiny1, 32))
-    printf(RED("You didn't split the 224B block!\n"));
-  else if (tiny3 != PTR_ADD_BYTES(tiny2, 32))
-    printf(RED("You didn't split the 192B block!\n"));
-  else if (tiny4 != PTR_ADD_BYTES(tiny3, 32))
-    printf(RED("You didn't split the 160B block!\n"));
+    printf(RED("You didn't split the 264B block!\n"));
+  else if (tiny2 != PTR_ADD_BYTES(tiny1, 24 + HEADER_SIZE))
+    printf(RED("You didn't split the 232B block!\n"));
+  else if (tiny3 != PTR_ADD_BYTES(tiny2, 24 + HEADER_SIZE))
+    printf(RED("You didn't split the 200B block!\n"));
+  else if (tiny4 != PTR_ADD_BYTES(tiny3, 24 + HEADER_SIZE))
+    printf(RED("You didn't split the 168B block!\n"));
 
   my_free(tiny1);
   my_free(tiny2);
@@ -328,9 +383,801 @@ void test_splitting() {
   check_heap_size("test_splitting", heap_at_start);
 }
 
+#define NUM_THREADS 4
+#define THREAD_ARRAYS 64
+#define THREAD_ROUNDS 200
+#define THREAD_BURST 256
+
+// Allocates, checks and frees arrays over and over. Each thread fills its
+// arrays with its own id so any block handed out twice shows up.
+void* thread_worker(void* arg) {
+  int id = (int)(intptr_t)arg;
+  int* arrays[THREAD_ARRAYS];
+  int errors = 0;
+  int round, i, j;
+
+  for (round = 0; round < THREAD_ROUNDS; round++) {
+    for (i = 0; i < THREAD_ARRAYS; i++) {
+      int length = 1 + (round + i) % 40;
+      arrays[i] = my_malloc(sizeof(int) * length);
+      for (j = 0; j < length; j++) arrays[i][j] = id;
+    }
+
+    for (i = 0; i < THREAD_ARRAYS; i++) {
+      int length = 1 + (round + i) % 40;
+      for (j = 0; j < length; j++)
+        if (arrays[i][j] != id) errors++;
+      my_free(arrays[i]);
+    }
+  }
+
+  // Freeing many blocks of one size overflows the thread cache, which hands
+  // them on to the central bins
+  {
+    int* burst[THREAD_BURST];
+    for (i = 0; i < THREAD_BURST; i++) burst[i] = my_malloc(sizeof(int) * 8);
+    for (i = 0; i < THREAD_BURST; i++) my_free(burst[i]);
+  }
+
+  return (void*)(intptr_t)errors;
+}
+
+// Runs several threads through the allocator at once with the thread cache
+// turned on. Every cache is flushed when its thread exits and turning the
+// cache off drains the central bins, so the heap should still shrink back
+// to where it started.
+void test_threads() {
+  void* heap_at_start = start_test("test_threads");
+  pthread_t threads[NUM_THREADS];
+  my_lock_stats_t stats;
+  int errors = 0;
+  int i;
+
+  my_mallopt(MY_M_TCACHE_COUNT, 32);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], NULL, thread_worker, (void*)(intptr_t)i);
+
+  for (i = 0; i < NUM_THREADS; i++) {
+    void* result;
+    pthread_join(threads[i], &result);
+    errors += (int)(intptr_t)result;
+  }
+
+  my_malloc_lock_stats(&stats);
+  my_mallopt(MY_M_TCACHE_COUNT, 0);
+
+  if (errors)
+    printf(RED("%d values were overwritten by another thread!\n"), errors);
+  if (stats.arena_acquired == 0 || stats.bin_acquired == 0 ||
+      stats.arena_contended > stats.arena_acquired ||
+      stats.bin_contended > stats.bin_acquired)
+    printf(RED("The lock statistics make no sense!\n"));
+
+  check_heap_size("test_threads", heap_at_start);
+}
+
+// Every pointer handed out should be 16-byte aligned so SSE/AVX loads on it
+// are safe, whichever path the allocation took.
+void test_alignment() {
+  void* heap_at_start = start_test("test_alignment");
+  my_arena_t* arena = my_arena_create();
+  void* pointers[40];
+  int i;
+
+  for (i = 0; i < 20; i++) pointers[i] = my_malloc(1 + i * 13);
+  pointers[20] = my_malloc(1024 * 1024 + 1);
+  for (i = 21; i < 40; i++) pointers[i] = my_arena_malloc(arena, 1 + i * 7);
+
+  for (i = 0; i < 40; i++)
+    if ((uintptr_t)pointers[i] % 16 != 0)
+      printf(RED("Pointer %d (%p) is not 16-byte aligned!\n"), i, pointers[i]);
+
+  for (i = 0; i < 21; i++) my_free(pointers[i]);
+  my_arena_destroy(arena);
+
+  check_heap_size("test_alignment", heap_at_start);
+}
+
+// Large allocations get their own mapping, so the heap should not move at
+// all while they are alive.
+void test_large() {
+  void* heap_at_start = start_test("test_large");
+  int length = 1024 * 1024;
+  int* big = make_array(length);
+
+  if (sbrk(0) != heap_at_start)
+    printf(RED("A 4MB allocation grew the heap!\n"));
+  if (big[length - 1] != length)
+    printf(RED("The end of the large allocation was overwritten!\n"));
+
+  my_free(big);
+
+  check_heap_size("test_large", heap_at_start);
+}
+
+// Fills a private arena, frees part of it the usual way and drops the rest
+// with the arena. None of it should come from the sbrk heap.
+void test_arenas() {
+  void* heap_at_start = start_test("test_arenas");
+  my_arena_t* arena = my_arena_create();
+  int* arrays[100];
+  int i, j;
+
+  if (arena == NULL) {
+    printf(RED("Could not create an arena!\n"));
+    return;
+  }
+
+  for (i = 0; i < 100; i++) {
+    arrays[i] = my_arena_malloc(arena, sizeof(int) * (i + 1));
+    fill_array(arrays[i], i + 1);
+  }
+
+  for (i = 0; i < 100; i++)
+    for (j = 0; j <= i; j++)
+      if (arrays[i][j] != j + 1) {
+        printf(RED("Array %d was overwritten!\n"), i);
+        break;
+      }
+
+  for (i = 0; i < 100; i += 2) my_free(arrays[i]);
+
+  my_arena_destroy(arena);
+
+  check_heap_size("test_arenas", heap_at_start);
+}
+
+// calloc has to hand back zeroed memory whether the block is reused, carved
+// from memory that was used before, or fresh from the OS.
+void test_calloc() {
+  void* heap_at_start = start_test("test_calloc");
+  int* dirty = make_array(100);
+  int* guard = make_array(4);
+  int* zeroed[3];
+  int i, j;
+
+  // Reuses dirty's block once it is in a bin
+  my_free(dirty);
+  zeroed[0] = my_calloc(100, sizeof(int));
+  zeroed[1] = my_calloc(1000, sizeof(int));
+  zeroed[2] = my_calloc(1024 * 1024, sizeof(int));
+
+  for (i = 0; i < 3; i++) {
+    int length = i == 0 ? 100 : i == 1 ? 1000 : 1024 * 1024;
+    for (j = 0; j < length; j++)
+      if (zeroed[i][j] != 0) {
+        printf(RED("calloc %d handed back memory that was not zeroed!\n"), i);
+        break;
+      }
+  }
+
+  if (my_calloc((size_t)-1 / 2, 4) != NULL)
+    printf(RED("calloc did not catch an overflowing size!\n"));
+
+  for (i = 0; i < 3; i++) my_free(zeroed[i]);
+  my_free(guard);
+
+  check_heap_size("test_calloc", heap_at_start);
+}
+
+// realloc should only move a block when it has to: shrinking, growing into a
+// free neighbor and growing at the top of the heap all happen in place.
+void test_realloc() {
+  void* heap_at_start = start_test("test_realloc");
+  int* a = make_array(10);
+  int* b = make_array(10);
+  int* c = make_array(10);
+  int* moved;
+  int i;
+
+  // a has 40 bytes of data, b's 40 bytes plus its header make room for 80
+  my_free(b);
+  if (my_realloc(a, sizeof(int) * 20) != a)
+    printf(RED("Growing into a free neighbor moved the block!\n"));
+
+  if (my_realloc(a, sizeof(int) * 10) != a)
+    printf(RED("Shrinking moved the block!\n"));
+
+  if (my_realloc(c, sizeof(int) * 1000) != c)
+    printf(RED("Growing the top block moved it!\n"));
+
+  // c is in the way now, so a has to move
+  moved = my_realloc(a, sizeof(int) * 2000);
+  if (moved == a) printf(RED("A block grew over its neighbor!\n"));
+
+  for (i = 0; i < 10; i++)
+    if (moved[i] != i + 1 || c[i] != i + 1) {
+      printf(RED("realloc lost the contents of a block!\n"));
+      break;
+    }
+
+  a = my_realloc(NULL, sizeof(int) * 10);
+  if (a == NULL) printf(RED("realloc(NULL, ...) did not allocate!\n"));
+
+  my_free(a);
+  my_free(moved);
+  my_free(c);
+
+  check_heap_size("test_realloc", heap_at_start);
+}
+
+// Aligned allocations must honor any power of two, both from the heap and
+// from their own mapping, and the padding around them must be given back.
+void test_aligned_alloc() {
+  void* heap_at_start = start_test("test_aligned_alloc");
+  void* pointers[10];
+  void* ptr;
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    size_t alignment = (size_t)32 << i;
+    pointers[i] = my_aligned_alloc(alignment, 100 + i);
+    if ((uintptr_t)pointers[i] % alignment != 0)
+      printf(RED("Pointer %d (%p) is not %zu-byte aligned!\n"), i,
+             pointers[i], alignment);
+    if (my_malloc_usable_size(pointers[i]) < 100 + (size_t)i)
+      printf(RED("Pointer %d is too small!\n"), i);
+  }
+
+  pointers[9] = my_aligned_alloc(64 * 1024, 1024 * 1024);
+  if ((uintptr_t)pointers[9] % (64 * 1024) != 0)
+    printf(RED("The large allocation is not 64KB aligned!\n"));
+
+  if (my_posix_memalign(&ptr, 24, 100) != EINVAL)
+    printf(RED("posix_memalign accepted an alignment of 24!\n"));
+  if (my_posix_memalign(&ptr, 256, 100) != 0 || (uintptr_t)ptr % 256 != 0)
+    printf(RED("posix_memalign did not align to 256!\n"));
+  else
+    my_free(ptr);
+
+  for (i = 0; i < 10; i++) my_free(pointers[i]);
+
+  check_heap_size("test_aligned_alloc", heap_at_start);
+}
+
+// Small objects come from slabs: pages of same sized objects with no header
+// in between, so consecutive allocations of one size sit right next to each
+// other and never touch the sbrk heap.
+#define SLAB_OBJECTS 100
+
+void test_slabs() {
+  void* heap_at_start = start_test("test_slabs");
+  char* objects[SLAB_OBJECTS];
+  void* ptr;
+  int i;
+
+  my_mallopt(MY_M_SLAB_MAX, 512);
+
+  for (i = 0; i < SLAB_OBJECTS; i++) objects[i] = my_malloc(16);
+
+  for (i = 1; i < SLAB_OBJECTS; i++)
+    if (objects[i] != objects[i - 1] + 16) {
+      printf(RED("Slab object %d is not right after the one before!\n"), i);
+      break;
+    }
+  if (my_malloc_usable_size(objects[0]) != 16)
+    printf(RED("A 16 byte slab object has room for %zu bytes!\n"),
+           my_malloc_usable_size(objects[0]));
+  if (sbrk(0) != heap_at_start)
+    printf(RED("Slab objects were taken from the sbrk heap!\n"));
+
+  // Freed objects are handed out again first
+  my_free(objects[50]);
+  ptr = my_malloc(10);
+  if (ptr != objects[50]) printf(RED("A freed slab object was not reused!\n"));
+
+  if (my_realloc(ptr, 16) != ptr)
+    printf(RED("Resizing within the object size moved it!\n"));
+  objects[50] = my_realloc(ptr, 100);
+  if (objects[50] == ptr)
+    printf(RED("Growing past the object size did not move it!\n"));
+
+  for (i = 0; i < SLAB_OBJECTS; i++) my_free(objects[i]);
+
+  my_mallopt(MY_M_SLAB_MAX, 0);
+
+  check_heap_size("test_slabs", heap_at_start);
+}
+
+void test_stats() {
+  void* heap_at_start = start_test("test_stats");
+  my_malloc_stats_t before, after;
+  char *a, *b, *c, *big;
+  size_t b_size;
+
+  my_malloc_stats(&before);
+  a = my_malloc(100);
+  b = my_malloc(2000);
+  c = my_malloc(100);
+  big = my_malloc(1024 * 1024);
+  my_malloc_stats(&after);
+
+  if (after.allocated_blocks != before.allocated_blocks + 4)
+    printf(RED("Expected 4 more allocated blocks, got %zu more!\n"),
+           after.allocated_blocks - before.allocated_blocks);
+  if (after.allocated_bytes - before.allocated_bytes !=
+      my_malloc_usable_size(a) + my_malloc_usable_size(b) +
+          my_malloc_usable_size(c) + my_malloc_usable_size(big))
+    printf(RED("Allocated bytes do not add up to the usable sizes!\n"));
+  if (after.mapped_blocks != before.mapped_blocks + 1 ||
+      after.mapped_bytes < before.mapped_bytes + 1024 * 1024)
+    printf(RED("The big block was not counted as mapped!\n"));
+
+  // b sits between two taken blocks, so it stays a free block of its own
+  b_size = my_malloc_usable_size(b);
+  my_free(b);
+  my_malloc_stats(&before);
+  if (before.free_blocks != after.free_blocks + 1 ||
+      before.free_bytes != after.free_bytes + b_size)
+    printf(RED("The freed block was not counted as free!\n"));
+  if (before.free_by_class[6] != after.free_by_class[6] + 1)
+    printf(RED("The freed block is not in the 1024 to 2047 byte class!\n"));
+  if (before.largest_free_block < b_size)
+    printf(RED("The largest free block is only %zu bytes!\n"),
+           before.largest_free_block);
+  if (before.fragmentation < 0 || before.fragmentation >= 1)
+    printf(RED("Fragmentation of %f is out of range!\n"),
+           before.fragmentation);
+
+  my_free(a);
+  my_free(c);
+  my_free(big);
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks - 3 ||
+      after.mapped_blocks != before.mapped_blocks - 1)
+    printf(RED("Freed blocks are still counted as allocated!\n"));
+
+  check_heap_size("test_stats", heap_at_start);
+}
+
+#define PURGE_SIZE (64 * 1024)
+
+void test_purge() {
+  void* heap_at_start = start_test("test_purge");
+  my_malloc_stats_t stats;
+  char *block, *guard;
+  int i;
+
+  // Purge big free blocks as soon as they are freed
+  my_mallopt(MY_M_PURGE_DECAY, 0);
+
+  block = my_malloc(PURGE_SIZE);
+  guard = my_malloc(16);
+  for (i = 0; i < PURGE_SIZE; i++) block[i] = 1;
+
+  // The guard keeps the block from being given back with brk()
+  my_free(block);
+  my_malloc_stats(&stats);
+  if (stats.purged_bytes < PURGE_SIZE - 2 * 4096 ||
+      stats.purged_bytes > PURGE_SIZE)
+    printf(RED("Expected all but two pages of the block to be purged, "
+               "got %zu bytes!\n"),
+           stats.purged_bytes);
+
+  // Its memory is still good to use, and the middle reads back as zero
+  block = my_malloc(PURGE_SIZE);
+  if (block[PURGE_SIZE / 2] != 0)
+    printf(RED("A purged page was not zero!\n"));
+  for (i = 0; i < PURGE_SIZE; i++) block[i] = 2;
+  my_malloc_stats(&stats);
+  if (stats.purged_bytes != 0)
+    printf(RED("Reused memory still counts as purged!\n"));
+
+  my_free(block);
+  my_free(guard);
+  my_mallopt(MY_M_PURGE_DECAY, 10000);
+
+  check_heap_size("test_purge", heap_at_start);
+}
+
+#define PROFILE_FILE "bigdriver_profile.heap"
+#define PROFILE_BLOCKS 10
+
+// Reads the totals from the first line of a heap profile
+int read_profile(size_t* count, size_t* bytes) {
+  FILE* file = fopen(PROFILE_FILE, "r");
+  int found;
+
+  if (file == NULL) return 0;
+  found = fscanf(file, "heap profile: %zu: %zu", count, bytes) == 2;
+  fclose(file);
+  return found;
+}
+
+void test_profile() {
+  void* heap_at_start = start_test("test_profile");
+  char* blocks[PROFILE_BLOCKS];
+  size_t count, bytes;
+  int i;
+
+  // Sample every allocation
+  my_mallopt(MY_M_PROFILE_RATE, 1);
+
+  for (i = 0; i < PROFILE_BLOCKS; i++) blocks[i] = my_malloc(1000);
+  blocks[0] = my_realloc(blocks[0], 5000);
+
+  if (my_malloc_profile_dump(PROFILE_FILE) != 0 ||
+      !read_profile(&count, &bytes))
+    printf(RED("Could not write or read the heap profile!\n"));
+  else if (count != PROFILE_BLOCKS ||
+           bytes != (PROFILE_BLOCKS - 1) * 1000 + 5000)
+    printf(RED("Expected %d samples of %d bytes, got %zu of %zu!\n"),
+           PROFILE_BLOCKS, (PROFILE_BLOCKS - 1) * 1000 + 5000, count, bytes);
+
+  for (i = 0; i < PROFILE_BLOCKS; i++) my_free(blocks[i]);
+
+  if (my_malloc_profile_dump(PROFILE_FILE) != 0 ||
+      !read_profile(&count, &bytes) || count != 0)
+    printf(RED("Freed memory is still in the heap profile!\n"));
+
+  my_mallopt(MY_M_PROFILE_RATE, 0);
+  unlink(PROFILE_FILE);
+
+  check_heap_size("test_profile", heap_at_start);
+}
+
+#define TRIM_SIZE (128 * 1024)
+
+void test_trim() {
+  void* heap_at_start = start_test("test_trim");
+  void *top, *blocks[3];
+  int i;
+
+  my_mallopt(MY_M_TRIM_THRESHOLD, TRIM_SIZE);
+  my_mallopt(MY_M_TOP_PAD, TRIM_SIZE);
+
+  // Allocating and freeing at the top of the heap moves the break once
+  my_free(my_malloc(1000));
+  top = sbrk(0);
+  for (i = 0; i < 1000; i++) my_free(my_malloc(1000 + i));
+  if (sbrk(0) != top)
+    printf(RED("The break moved while reusing the top of the heap!\n"));
+
+  // Freeing a lot shrinks the heap, but only down to the pad
+  for (i = 0; i < 3; i++) blocks[i] = my_malloc(100000);
+  for (i = 0; i < 3; i++) my_free(blocks[i]);
+  if ((char*)sbrk(0) - (char*)heap_at_start < TRIM_SIZE ||
+      (char*)sbrk(0) - (char*)heap_at_start > 2 * TRIM_SIZE)
+    printf(RED("Expected the heap to keep about %d bytes, it kept %ld!\n"),
+           TRIM_SIZE, (long)((char*)sbrk(0) - (char*)heap_at_start));
+
+  // Without a threshold or pad the next free gives everything back
+  my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+  my_mallopt(MY_M_TOP_PAD, 0);
+  my_free(my_malloc(16));
+
+  check_heap_size("test_trim", heap_at_start);
+}
+
+#define CHUNK_BLOCKS 1000
+
+void test_heap_chunk() {
+  void* heap_at_start = start_test("test_heap_chunk");
+  static void* blocks[CHUNK_BLOCKS];
+  void* top = sbrk(0);
+  int moves = 0;
+  int i;
+
+  my_mallopt(MY_M_HEAP_CHUNK, 64 * 1024);
+
+  // About 1MB in 1000 blocks takes a handful of chunks, not 1000 sbrk()s
+  for (i = 0; i < CHUNK_BLOCKS; i++) {
+    blocks[i] = my_malloc(1000 + i);
+    if (sbrk(0) != top) {
+      top = sbrk(0);
+      moves++;
+    }
+  }
+  if (moves > 8)
+    printf(RED("Growing the heap by 1MB moved the break %d times!\n"), moves);
+
+  for (i = 0; i < CHUNK_BLOCKS; i++) my_free(blocks[i]);
+  my_mallopt(MY_M_HEAP_CHUNK, 0);
+
+  check_heap_size("test_heap_chunk", heap_at_start);
+}
+
+// Checks whether the mapping holding ptr was marked MADV_HUGEPAGE, from the
+// VmFlags line of /proc/self/smaps. Returns -1 if it cannot tell.
+int has_huge_pages(void* ptr) {
+  FILE* smaps = fopen("/proc/self/smaps", "r");
+  char line[256];
+  int in_mapping = 0;
+  int found = -1;
+
+  if (smaps == NULL) return -1;
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long start, end;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+      in_mapping = (uintptr_t)ptr >= start && (uintptr_t)ptr < end;
+    else if (in_mapping && strncmp(line, "VmFlags:", 8) == 0)
+      found = strstr(line, " hg") != NULL;
+  }
+  fclose(smaps);
+  return found;
+}
+
+void test_huge_pages() {
+  void* heap_at_start = start_test("test_huge_pages");
+  my_arena_t *plain, *huge;
+  void *small, *big;
+
+  // Only regions mapped after the switch get huge pages. A private arena
+  // keeps the main arena on sbrk() for the tests after this one.
+  plain = my_arena_create();
+  my_mallopt(MY_M_HUGE_PAGES, 1);
+  huge = my_arena_create();
+  my_mallopt(MY_M_HUGE_PAGES, 0);
+
+  small = my_arena_malloc(plain, 1000);
+  big = my_arena_malloc(huge, 1000);
+  if (access("/sys/kernel/mm/transparent_hugepage/enabled", F_OK) != 0) {
+    printf(YELLOW("No transparent huge pages here, skipping the check\n"));
+  } else {
+    if (has_huge_pages(small) != 0)
+      printf(RED("A region was mapped with huge pages while they were off!\n"));
+    if (has_huge_pages(big) != 1)
+      printf(RED("A region was mapped without huge pages while they were on!\n"));
+  }
+
+  my_arena_destroy(plain);
+  my_arena_destroy(huge);
+
+  check_heap_size("test_huge_pages", heap_at_start);
+}
+
+typedef struct NumaResult {
+  void* ptr;
+  unsigned int node;
+} NumaResult;
+
+void* numa_worker(void* arg) {
+  NumaResult* result = arg;
+  unsigned int cpu;
+
+  syscall(SYS_getcpu, &cpu, &result->node, NULL);
+  result->ptr = my_malloc(1000);
+  return NULL;
+}
+
+void test_numa_arenas() {
+  void* heap_at_start = start_test("test_numa_arenas");
+  NumaResult result;
+  pthread_t thread;
+  unsigned long mask = 0;
+  int mode = -1;
+
+  // A thread that starts allocating now gets an arena of its node, whose
+  // memory prefers that node (mode 1 is MPOL_PREFERRED)
+  my_mallopt(MY_M_NUMA_ARENAS, 1);
+  pthread_create(&thread, NULL, numa_worker, &result);
+  pthread_join(thread, NULL);
+  my_mallopt(MY_M_NUMA_ARENAS, 0);
+
+  if (syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8, result.ptr,
+              2 /* MPOL_F_ADDR */) != 0)
+    printf(YELLOW("No NUMA policies here, skipping the check\n"));
+  else if (mode != 1 || mask != 1UL << result.node)
+    printf(RED("Memory of node %u had policy %d, nodes 0x%lx!\n"),
+           result.node, mode, mask);
+
+  // Freed from another thread, it goes straight back to its arena
+  my_free(result.ptr);
+
+  check_heap_size("test_numa_arenas", heap_at_start);
+}
+
+#define REMOTE_BLOCKS 100
+
+void* remote_blocks[REMOTE_BLOCKS];
+pthread_barrier_t remote_barrier;
+
+void* remote_owner(void* arg) {
+  int i;
+
+  for (i = 0; i < REMOTE_BLOCKS; i++) remote_blocks[i] = my_malloc(1000);
+  pthread_barrier_wait(&remote_barrier);
+
+  // The main thread frees the blocks; the next malloc here frees whatever it
+  // queued on this thread's arena
+  pthread_barrier_wait(&remote_barrier);
+  my_free(my_malloc(1000));
+  return NULL;
+}
+
+// Allocates half the blocks and exits without ever taking its arena's lock
+// again
+void* remote_exiting_owner(void* arg) {
+  void** blocks = arg;
+  int i;
+
+  for (i = 0; i < REMOTE_BLOCKS / 2; i++) blocks[i] = my_malloc(1000);
+  return NULL;
+}
+
+void test_remote_free() {
+  void* heap_at_start = start_test("test_remote_free");
+  my_malloc_stats_t before, after;
+  pthread_t thread;
+  int i;
+
+  my_malloc_stats(&before);
+  pthread_barrier_init(&remote_barrier, NULL, 2);
+  pthread_create(&thread, NULL, remote_owner, NULL);
+
+  pthread_barrier_wait(&remote_barrier);
+  for (i = 0; i < REMOTE_BLOCKS; i++) my_free(remote_blocks[i]);
+  pthread_barrier_wait(&remote_barrier);
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&remote_barrier);
+
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks)
+    printf(RED("%ld blocks freed by another thread were never released!\n"),
+           (long)(after.allocated_blocks - before.allocated_blocks));
+
+  // With the owner gone, nobody would ever drain its arena's queue, so the
+  // blocks have to be freed into the arena right away. Threads take turns at
+  // the arenas, so at least one of two owners in a row has an arena other
+  // than this thread's.
+  for (i = 0; i < 2; i++) {
+    pthread_create(&thread, NULL, remote_exiting_owner,
+                   remote_blocks + i * REMOTE_BLOCKS / 2);
+    pthread_join(thread, NULL);
+  }
+  my_malloc_stats(&before);
+  for (i = 0; i < REMOTE_BLOCKS; i++) my_free(remote_blocks[i]);
+
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks - REMOTE_BLOCKS)
+    printf(RED("%ld blocks freed after their thread exited are stranded!\n"),
+           (long)(after.allocated_blocks - before.allocated_blocks +
+                  REMOTE_BLOCKS));
+  // Back in the arena as free blocks, or merged into the space at its top
+  // that has not been carved yet
+  if (after.heap_bytes - after.free_bytes >
+      before.heap_bytes - before.free_bytes - REMOTE_BLOCKS * 1000)
+    printf(RED("Blocks freed after their thread exited are not reusable!\n"));
+
+  check_heap_size("test_remote_free", heap_at_start);
+}
+
+#define BATCH_COUNT 1000
+
+void test_batch() {
+  void* heap_at_start = start_test("test_batch");
+  static void* ptrs[BATCH_COUNT];
+  my_malloc_stats_t before, after;
+  size_t got;
+  int i;
+
+  my_malloc_stats(&before);
+  got = my_malloc_batch(100, BATCH_COUNT, ptrs);
+  if (got != BATCH_COUNT)
+    printf(RED("Expected %d objects from the batch, got %zu!\n"), BATCH_COUNT,
+           got);
+
+  // Blocks of a batch are carved side by side: 100 rounds up to 104 bytes
+  // of data after an 8 byte header
+  for (i = 0; i < BATCH_COUNT; i++) {
+    if ((uintptr_t)ptrs[i] % 16 != 0)
+      printf(RED("Batch object %d (%p) is not 16-byte aligned!\n"), i, ptrs[i]);
+    memset(ptrs[i], i, 100);
+  }
+  if (ptrs[1] != PTR_ADD_BYTES(ptrs[0], 104 + HEADER_SIZE))
+    printf(RED("Batch objects are %ld bytes apart, expected 112!\n"),
+           (long)((char*)ptrs[1] - (char*)ptrs[0]));
+  for (i = 0; i < BATCH_COUNT; i++)
+    if (*(unsigned char*)ptrs[i] != (unsigned char)i)
+      printf(RED("Batch object %d was overwritten!\n"), i);
+
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks + BATCH_COUNT)
+    printf(RED("Expected %d more allocated blocks, got %zu more!\n"),
+           BATCH_COUNT, after.allocated_blocks - before.allocated_blocks);
+
+  // The first half is freed in order, so it is merged into one block. The
+  // rest is freed backwards and with holes, one block at a time.
+  my_free_batch(ptrs, BATCH_COUNT / 2);
+  for (i = BATCH_COUNT / 2; i < BATCH_COUNT * 3 / 4; i++) {
+    void* swap = ptrs[i];
+    ptrs[i] = ptrs[BATCH_COUNT * 3 / 2 - 1 - i];
+    ptrs[BATCH_COUNT * 3 / 2 - 1 - i] = swap;
+  }
+  my_free(ptrs[BATCH_COUNT / 2 + 10]);
+  ptrs[BATCH_COUNT / 2 + 10] = NULL;
+  my_free_batch(ptrs + BATCH_COUNT / 2, BATCH_COUNT / 2);
+
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks ||
+      after.free_blocks != before.free_blocks)
+    printf(RED("The batch did not free every block!\n"));
+
+  // Small objects come from slabs
+  my_mallopt(MY_M_SLAB_MAX, 512);
+  got = my_malloc_batch(32, BATCH_COUNT, ptrs);
+  my_malloc_stats(&after);
+  if (got != BATCH_COUNT ||
+      after.slab_objects != before.slab_objects + BATCH_COUNT)
+    printf(RED("Expected %d slab objects from the batch!\n"), BATCH_COUNT);
+  my_free_batch(ptrs, got);
+  my_mallopt(MY_M_SLAB_MAX, 0);
+
+  check_heap_size("test_batch", heap_at_start);
+}
+
+// Runs on a thread of its own so the memory usually comes from a shared
+// arena's region, where my_free_sized() caches slab objects without looking
+// at their slab
+void* sized_owner(void* arg) {
+  static const size_t sizes[] = {1, 24, 100, 200, 240};
+  int* errors = arg;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    void* ptr = my_malloc(sizes[i]);
+    void* again;
+
+    my_free_sized(ptr, sizes[i]);
+    again = my_malloc(sizes[i]);
+    if (again != ptr) (*errors)++;
+    my_free_sized(again, sizes[i]);
+  }
+  return NULL;
+}
+
+void test_free_sized() {
+  void* heap_at_start = start_test("test_free_sized");
+  my_malloc_stats_t before, after;
+  pthread_t thread;
+  int errors = 0;
+  int i;
+
+  my_mallopt(MY_M_CHECK_FREE_SIZE, 1);
+  my_malloc_stats(&before);
+
+  // Blocks, then slab objects, go back to the thread cache by their size.
+  // Threads take turns at the arenas, and one of each pair gets an arena
+  // other than the main one.
+  my_mallopt(MY_M_TCACHE_COUNT, 32);
+  for (i = 0; i < 4; i++) {
+    my_mallopt(MY_M_SLAB_MAX, i < 2 ? 0 : 512);
+    pthread_create(&thread, NULL, sized_owner, &errors);
+    pthread_join(thread, NULL);
+  }
+  my_mallopt(MY_M_SLAB_MAX, 0);
+  my_mallopt(MY_M_TCACHE_COUNT, 0);
+  if (errors > 0)
+    printf(RED("%d objects freed by size were not reused right away!\n"),
+           errors);
+
+  // The sbrk heap and mappings are freed the usual way
+  my_free_sized(my_malloc(100), 100);
+  my_free_sized(my_malloc(200 * 1024), 200 * 1024);
+  my_free_sized(NULL, 0);
+
+  my_malloc_stats(&after);
+  if (after.allocated_blocks != before.allocated_blocks ||
+      after.mapped_blocks != before.mapped_blocks)
+    printf(RED("Memory freed by size was never released!\n"));
+  my_mallopt(MY_M_CHECK_FREE_SIZE, 0);
+
+  check_heap_size("test_free_sized", heap_at_start);
+}
+
 int main() {
   void* heap_at_start = sbrk(0);
 
+  // These tests look at exactly where blocks land on the heap, so keep the
+  // thread cache from holding on to freed blocks, small requests from going
+  // to slabs, and the heap from growing or shrinking by more than asked.
+  my_mallopt(MY_M_TCACHE_COUNT, 0);
+  my_mallopt(MY_M_SLAB_MAX, 0);
+  my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+  my_mallopt(MY_M_TOP_PAD, 0);
+  my_mallopt(MY_M_HEAP_CHUNK, 0);
+
   // Uncomment a test and recompile before running it.
   // When complete, you should be able to uncomment all the tests
   // and they should run flawlessly.
@@ -338,8 +1185,27 @@ int main() {
   test_writing();
   test_reuse();
   test_first_fit();
+  test_best_fit();
   test_coalescing();
   test_splitting();
+  test_alignment();
+  test_large();
+  test_threads();
+  test_arenas();
+  test_calloc();
+  test_realloc();
+  test_aligned_alloc();
+  test_slabs();
+  test_stats();
+  test_profile();
+  test_purge();
+  test_trim();
+  test_heap_chunk();
+  test_huge_pages();
+  test_numa_arenas();
+  test_remote_free();
+  test_batch();
+  test_free_sized();
 
   // Just to make sure!
   check_heap_size("main", heap_at_start);
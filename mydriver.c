@@ -14,6 +14,14 @@ int main() {
   // before and after your tests, like here.
   void* heap_at_start = sbrk(0);
 
+  // Freed blocks would otherwise sit in this thread's cache, or at the top
+  // of the heap, and show up as heap growth below. So would the rest of a
+  // chunk the heap grew by.
+  my_mallopt(MY_M_TCACHE_COUNT, 0);
+  my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+  my_mallopt(MY_M_TOP_PAD, 0);
+  my_mallopt(MY_M_HEAP_CHUNK, 0);
+
   // void* block =
 
   // my_free(block);
@@ -2,16 +2,47 @@
  * Author: Joshua Sizer
  *
  * This is a custom implementation of malloc/free.
- * I use a linked list to keep track of used/free
- * blocks of memory. To allocate a user new
- * memory, a first fit algorithm is used before
- * requesting more memory from the OS. When possible,
+ * Blocks of memory are laid out back to back,
+ * each starting with a one word header holding
+ * its size and whether it is free. Free blocks
+ * also repeat their size in a footer at the end
+ * of their data (a "boundary tag"), so both
+ * neighbors of a block can be found by address
+ * arithmetic alone. Small free blocks are kept in
+ * segregated lists ("bins") by size, large ones in
+ * a balanced tree ordered by size, so finding
+ * memory for a new allocation only looks at free
+ * blocks of a suitable size before requesting
+ * more memory from the OS. When possible,
  * neighboring free blocks are coalesced into one
  * in order to reduce external fragmentation.
+ *
+ * Each arena is an independent heap with its own
+ * bins and lock. The main arena grows with
+ * sbrk(); every other arena is made of regions
+ * obtained with mmap(). Threads are spread over a
+ * pool of arenas round-robin, and callers can
+ * create private arenas to release in one go.
+ *
+ * Small objects are served from slabs instead:
+ * pages of same sized objects with no header at
+ * all, found again by masking the pointer.
  */
+// mremap() is a GNU extension
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mymalloc.h"
@@ -20,49 +51,594 @@
 // pointer
 #define PTR_ADD_BYTES(ptr, byte_offs) ((void *)(((char *)(ptr)) + (byte_offs)))
 
-#define MINIMUM_ALLOCATION 16
-#define SIZE_MULTIPLE 8
+// Round value up to a multiple of align, which
+// must be a power of two
+#define ALIGN_UP(value, align) \
+  (((uintptr_t)(value) + ((align) - 1)) & ~((uintptr_t)(align) - 1))
 
+// Every data segment is aligned to SIZE_MULTIPLE
+// bytes, which makes them safe for 16 byte
+// SSE/AVX loads. Headers sit in the 8 bytes
+// before, so header + data is always a multiple
+// of SIZE_MULTIPLE. MINIMUM_ALLOCATION is the
+// smallest data segment that can hold FreeLinks
+// and a footer once the block is freed.
+#define MINIMUM_ALLOCATION 24
+#define SIZE_MULTIPLE 16
+
+// Flags kept in the low bits of a header. Data
+// sizes are always multiples of 8, so those bits
+// are otherwise unused.
 #define FREE 1
 #define TAKEN 0
+// The block right before this one is FREE, so the
+// word before this header is its footer
+#define PREV_FREE 2
+// A block with its own mmap() region, outside of
+// any arena. It is never FREE: my_free() unmaps it.
+#define MAPPED 4
+#define FLAG_MASK 7
+
+// Requests of at least this many bytes get their
+// own mapping by default
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+// The sbrk heap is only shrunk once the free
+// block at its top has grown to trim_threshold
+// bytes, and then keeps top_pad bytes of it.
+// Growing it asks for top_pad bytes more than
+// needed. Both keep a program that allocates and
+// frees at the top of the heap from calling
+// sbrk() and brk() in turn on every call.
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#define DEFAULT_TOP_PAD (128 * 1024)
+
+// The sbrk heap grows by at least a chunk at a
+// time, starting at heap_chunk_min bytes and
+// doubling with every growth up to
+// HEAP_CHUNK_MAX, so a program building up its
+// heap makes a handful of sbrk() calls instead of
+// one per block. The unused tail of a chunk is
+// the free block that the next requests are
+// carved from.
+#define DEFAULT_HEAP_CHUNK (64 * 1024)
+#define HEAP_CHUNK_MAX (1024 * 1024)
+
+// Free blocks below TREE_MIN_SIZE are kept in
+// segregated lists by size, one exact bin per
+// SIZE_MULTIPLE. Free blocks of TREE_MIN_SIZE and
+// up go into a balanced tree ordered by size and
+// address instead, so they can be found best-fit.
+#define TREE_MIN_SIZE 1024
+#define NUM_BINS (TREE_MIN_SIZE / SIZE_MULTIPLE)
+
+// Arena.bin_map has one bit per bin
+_Static_assert(NUM_BINS <= 64, "bin_map has too few bits");
+
+// Built with -DMYMALLOC_TLSF, every free block
+// goes into one of the lists of a two-level
+// segregated fit (TLSF) index instead of the bins
+// and the tree. The first level splits sizes by
+// power of two, the second splits each power of
+// two into TLSF_SL_COUNT equal steps. Sizes below
+// TLSF_SMALL_SIZE share first level 0 in steps of
+// SIZE_MULTIPLE. A bitmap per level finds a list
+// that fits without ever walking one, so finding
+// a free block takes constant time.
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_FL_SHIFT (TLSF_SL_SHIFT + 4)
+#define TLSF_SMALL_SIZE ((size_t)1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+
+// Free blocks of at least PURGE_MIN_SIZE bytes
+// that stay free for purge_decay_ms give the
+// whole pages inside them back to the OS with
+// madvise(), keeping only the pages holding
+// their links and footer. Their PurgeLinks sit
+// PURGE_LINKS_OFFSET bytes into their data, past
+// the FreeLinks or TreeNode. Arenas look for
+// such blocks PURGE_SWEEPS times per decay
+// period.
+#define PURGE_MIN_SIZE (16 * 1024)
+#define PURGE_LINKS_OFFSET 32
+#define PURGE_SWEEPS 8
+#define DEFAULT_PURGE_DECAY_MS 10000
+
+// Small allocations are cached per thread, one
+// bin per SIZE_MULTIPLE up to TCACHE_MAX_SIZE.
+// Each bin holds at most tcache_count of them
+// and moves TCACHE_BATCH at a time to or from
+// the shared heap.
+#define TCACHE_MAX_SIZE 256
+#define NUM_TCACHE_BINS (TCACHE_MAX_SIZE / SIZE_MULTIPLE + 1)
+#define TCACHE_DEFAULT_COUNT 32
+#define TCACHE_MAX_COUNT 1024
+#define TCACHE_BATCH 16
+
+// Memory flushed from full thread caches waits
+// in its arena's central bin for that size, at
+// most CENTRAL_MAX_COUNT entries, before going
+// back to the arena itself. Each central bin has
+// its own lock and cache line.
+#define CENTRAL_MAX_COUNT (4 * TCACHE_BATCH)
+#define CACHE_LINE 64
+
+// Once this many frees wait on an arena's
+// remote_frees, the thread pushing the next one
+// frees them all if the arena's lock is free, so
+// an idle arena does not sit on its memory
+#define REMOTE_DRAIN_COUNT 256
+
+// Requests of up to slab_max bytes (at most
+// SLAB_MAX_SIZE) are rounded up to a multiple of
+// SIZE_MULTIPLE and served from slabs: SLAB_SIZE
+// pages holding objects of one size class each.
+// Slab pages are cut from regions of their own,
+// whose first page holds the Region struct.
+#define SLAB_MAX_SIZE 512
+#define DEFAULT_SLAB_MAX SLAB_MAX_SIZE
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / SIZE_MULTIPLE + 1)
+#define SLAB_SHIFT 16
+#define SLAB_SIZE ((size_t)1 << SLAB_SHIFT)
+
+// my_malloc_batch() carves blocks from runs of
+// at most BATCH_RUN_BYTES, each taken from the
+// arena as one block
+#define BATCH_RUN_BYTES (256 * 1024)
+
+// Arenas other than the main one are built from
+// regions of at least REGION_SIZE bytes, aligned
+// to REGION_SIZE so that region_map can find the
+// region of any address by shifting it.
+#define REGION_SHIFT 22
+#define REGION_SIZE ((size_t)1 << REGION_SHIFT)
+#define MAX_ARENAS 64
+#define SLABS_PER_REGION (REGION_SIZE / SLAB_SIZE)
+
+// With huge pages on, new regions are backed by
+// transparent huge pages of HUGE_PAGE_SIZE bytes,
+// which REGION_SIZE is a multiple of, and the
+// main arena grows with regions instead of
+// sbrk(). Purging such a region only gives back
+// whole huge pages so it never splits one, so
+// block regions are HUGE_REGION_SIZE bytes at
+// least, leaving whole huge pages between the
+// links and footer of a big free block.
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HUGE_REGION_SIZE (8 * REGION_SIZE)
+
+// With NUMA arenas on, each thread gets an arena
+// of the node it first allocates on, and that
+// arena's regions prefer the node's memory.
+// Nodes from MAX_NUMA_NODES - 1 on share the
+// arenas that prefer no node. mbind() is called
+// directly so there is no need for libnuma.
+#define MAX_NUMA_NODES 64
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// region_map is a two level table with one entry
+// per REGION_SIZE slot of the address space
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define ADDRESS_BITS 48
+#else
+#define ADDRESS_BITS 32
+#endif
+#define MAP_LEAF_BITS 10
+#define MAP_LEAF_SIZE (1 << MAP_LEAF_BITS)
+#define MAP_ROOT_SIZE (1 << (ADDRESS_BITS - REGION_SHIFT - MAP_LEAF_BITS))
 
 typedef struct Block Block;
+typedef struct FreeLinks FreeLinks;
+typedef struct TreeNode TreeNode;
+typedef struct PurgeLinks PurgeLinks;
+typedef struct ThreadCache ThreadCache;
+typedef struct LockStats LockStats;
+typedef struct CentralBin CentralBin;
+typedef struct ArenaStats ArenaStats;
+typedef struct Sample Sample;
+typedef struct Slab Slab;
+typedef struct Arena Arena;
+typedef struct Region Region;
 
-// Total size: 16 (0x10) bytes
+// Total size: 8 bytes. A TAKEN block carries no
+// other overhead. A FREE block also holds
+// FreeLinks at the start of its data and a copy
+// of its data size in the last word of its data.
+//
+// Every stretch of blocks ends in a fence: a
+// TAKEN header with a data size of 0, so the
+// last real block always has a next block to
+// look at.
 struct Block
+{
+  size_t size_and_flags;
+};
+
+// Blocks are laid out back to back, so the
+// smallest block has to keep the data segment of
+// the one after it aligned
+_Static_assert(sizeof(Block) == 8, "Block header must be one word");
+_Static_assert((sizeof(Block) + MINIMUM_ALLOCATION) % SIZE_MULTIPLE == 0,
+               "Blocks must preserve data alignment");
+
+// Stored in the data segment of a FREE block to
+// link it into its bin. MINIMUM_ALLOCATION
+// guarantees there is always room for it.
+struct FreeLinks
+{
+  Block *next_free;
+  Block *last_free;
+};
+
+// Stored in the data segment of a FREE block of
+// at least TREE_MIN_SIZE bytes instead of
+// FreeLinks, to link it into its arena's AVL
+// tree. height is that of the subtree rooted at
+// the block, 1 for a leaf.
+struct TreeNode
+{
+  Block *left;
+  Block *right;
+  size_t height;
+};
+
+// Stored in the data segment of a FREE block of
+// at least PURGE_MIN_SIZE bytes as well, to link
+// it into its arena's decay list while its pages
+// are still resident. freed_at is when it was
+// freed, in milliseconds of purge_clock().
+struct PurgeLinks
 {
   Block *next;
-  Block *last;
-  uint32_t is_free;
-  uint32_t data_size;
+  Block *prev;
+  uint64_t freed_at;
+  int purged;
+};
+
+_Static_assert(PURGE_LINKS_OFFSET >= sizeof(TreeNode) &&
+                   PURGE_LINKS_OFFSET >= sizeof(FreeLinks),
+               "PurgeLinks must not overlap the bin links");
+
+// A thread's private stash of allocated memory,
+// TAKEN blocks and slab objects alike, singly
+// linked through their first word. Bin i holds
+// memory with room for at least i *
+// SIZE_MULTIPLE bytes.
+struct ThreadCache
+{
+  void *entries[NUM_TCACHE_BINS];
+  uint16_t counts[NUM_TCACHE_BINS];
+  int initialized;
+};
+
+// How often a lock was taken, and how often it
+// was already held by another thread at the
+// time. Only updated with the lock held.
+struct LockStats
+{
+  unsigned long acquired;
+  unsigned long contended;
+};
+
+// Memory of one thread cache bin on its way from
+// the thread caches back to an arena, linked like
+// the thread cache
+struct CentralBin
+{
+  pthread_mutex_t lock;
+  LockStats lock_stats;
+  void *entries;
+  unsigned int count;
+} __attribute__((aligned(CACHE_LINE)));
+
+// Running totals behind my_malloc_stats(), kept
+// by the functions that change the heap so that
+// nothing has to be walked to read them. Blocks
+// are counted from the moment they are carved
+// until they are coalesced away or given back,
+// whether FREE or TAKEN. Only updated with the
+// arena's lock held.
+struct ArenaStats
+{
+  size_t blocks;
+  size_t block_bytes;
+  size_t free_blocks;
+  size_t free_bytes;
+  size_t slab_pages;
+  size_t slab_objects;
+  size_t slab_object_bytes;
+  size_t purged_bytes;
+  size_t blocks_by_class[MY_STATS_CLASSES];
+  size_t free_by_class[MY_STATS_CLASSES];
+  size_t slab_objects_by_class[MY_STATS_CLASSES];
+};
+
+// An independent heap
+struct Arena
+{
+  // Guards everything below except threads,
+  // central and the remote frees, and every Block
+  // of the arena that is not in a thread cache, a
+  // central bin or remote_frees
+  pthread_mutex_t lock;
+  LockStats lock_stats;
+
+#ifndef MYMALLOC_TLSF
+  // Heads of the free lists, indexed by
+  // bin_index()
+  Block *bins[NUM_BINS];
+
+  // Bit i is set while bins[i] is not empty
+  uint64_t bin_map;
+
+  // Root of the tree of free blocks too big for
+  // the bins
+  Block *tree;
+#else
+  // Heads of the free lists, indexed by
+  // tlsf_mapping(). Bit fl of tlsf_fl_map is set
+  // while tlsf_sl_map[fl] is not 0, and bit sl of
+  // that while tlsf_lists[fl][sl] is not empty.
+  Block *tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+  uint64_t tlsf_fl_map;
+  unsigned int tlsf_sl_map[TLSF_FL_COUNT];
+#endif
+
+  // Free blocks of at least PURGE_MIN_SIZE whose
+  // pages are still resident, in no particular
+  // order, and when they were last looked
+  // through
+  Block *decay_list;
+  uint64_t last_sweep;
+
+  // Regions backing the arena, newest first. New
+  // blocks are only carved from the newest one.
+  // Empty for the main arena, which uses sbrk()
+  // until huge pages are turned on.
+  Region *regions;
+
+  // Private arenas are only used through the
+  // my_arena_* functions, never cached per
+  // thread, and can be destroyed.
+  int is_private;
+
+  // The NUMA node the arena's memory comes from,
+  // -1 for any
+  int node;
+
+  // How many live threads allocate from the
+  // arena. Updated atomically, without the lock.
+  unsigned int threads;
+
+  // Slabs with free objects per size class,
+  // indexed by size / SIZE_MULTIPLE, and empty
+  // slab pages of any class. Both doubly linked
+  // through Slab.next and Slab.prev.
+  Slab *partial_slabs[NUM_SLAB_CLASSES];
+  Slab *free_slabs;
+
+  // Regions slab pages are cut from, newest
+  // first
+  Region *slab_regions;
+
+  ArenaStats stats;
+
+  // Memory freed by threads allocating from other
+  // arenas, linked through its first word and
+  // pushed without the lock, and about how many
+  // entries it holds. Whoever takes the lock next
+  // frees it all at once. On a cache line of its
+  // own since other threads write it.
+  void *remote_frees __attribute__((aligned(CACHE_LINE)));
+  size_t remote_count;
+
+  // Indexed like the thread cache bins. Unused by
+  // private arenas.
+  CentralBin central[NUM_TCACHE_BINS];
+};
+
+// A chunk of memory mapped for a non-main arena.
+// The struct sits at the start of the mapping.
+// Blocks are carved from the front of the free
+// space, starting at first. top is the fence
+// after the last block carved so far. Nothing
+// from clean onwards has ever been handed out, so
+// it is still zero from mmap().
+//
+// A slab region instead hands out its pages one
+// by one: next_slab is the index of the first
+// page never handed out, slabs_in_use the number
+// of pages holding objects.
+//
+// huge is set if the region was mapped with huge
+// pages on, and never changes after.
+struct Region
+{
+  Arena *arena;
+  Region *next;
+  size_t size;
+  Block *first;
+  Block *top;
+  char *clean;
+  int huge;
+
+  int is_slab;
+  unsigned int next_slab;
+  unsigned int slabs_in_use;
+};
+
+// The header at the start of every page of a slab
+// region, found by masking any object's address.
+// Objects are object_size bytes apart starting
+// right after it. Freed objects are linked
+// through their first word; objects from bump
+// onwards have never been handed out.
+struct Slab
+{
+  Slab *next;
+  Slab *prev;
+  void *free_list;
+  char *bump;
+  char *end;
+  unsigned int object_size;
+  unsigned int in_use;
 };
 
-// Global variables for head and tail
-Block *head = NULL;
-Block *tail = NULL;
+Arena main_arena = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .node = -1,
+    .central = {[0 ... NUM_TCACHE_BINS - 1] = {PTHREAD_MUTEX_INITIALIZER}}};
+
+// Where the break was before the main arena
+// first grew, the first block carved after it,
+// and the fence at the end of the sbrk heap. All
+// NULL while the main arena holds no memory.
+void *heap_start = NULL;
+Block *heap_first = NULL;
+Block *heap_fence = NULL;
+
+// Nothing in the sbrk heap from here onwards has
+// ever been handed out, so it is still zero
+char *heap_clean = NULL;
+
+// The shared arenas threads are spread over.
+// arenas[0] is always the main arena, the rest
+// are created on demand.
+Arena *arenas[MAX_ARENAS] = {&main_arena};
+unsigned int arena_max = 0;
+unsigned int next_arena = 0;
+pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread Arena *thread_arena;
+pthread_key_t arena_key;
+pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+// Maps every REGION_SIZE slot covered by a region
+// to that region. Leaves are mapped on demand.
+Region **region_map[MAP_ROOT_SIZE];
+pthread_mutex_t region_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+size_t slab_max = DEFAULT_SLAB_MAX;
+size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+size_t top_pad = DEFAULT_TOP_PAD;
+size_t heap_chunk_min = DEFAULT_HEAP_CHUNK;
+
+// Whether new regions get huge pages
+int huge_pages = 0;
+
+// Whether threads get arenas of their own NUMA
+// node
+int numa_arenas = 0;
+
+// Whether my_free_sized() checks the sizes it is
+// given against the memory
+int check_free_size = 0;
+
+// How much the sbrk heap grows by next, under
+// the main arena's lock
+size_t heap_chunk = DEFAULT_HEAP_CHUNK;
+
+// How long a big free block stays resident
+// before its pages are purged, -1 for never
+long purge_decay_ms = DEFAULT_PURGE_DECAY_MS;
+
+// Blocks mapped separately, which belong to no
+// arena: their number, the bytes mapped for them,
+// the data sizes in their headers and their
+// number per size class of my_malloc_stats_t.
+// Updated atomically.
+size_t mapped_blocks;
+size_t mapped_bytes;
+size_t mapped_data;
+size_t mapped_by_class[MY_STATS_CLASSES];
+
+// While trace_fd is open, every call to the
+// malloc family is recorded in trace_buffer,
+// which is written out whenever it fills up.
+// Records are appended under trace_lock in the
+// order the calls took effect.
+#define TRACE_BUFFER_RECORDS 4096
+
+int trace_fd = -1;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+my_trace_record_t trace_buffer[TRACE_BUFFER_RECORDS];
+unsigned int trace_count;
+uint64_t trace_start_ns;
+uint32_t trace_threads;
+__thread uint32_t trace_thread;
+
+// Set while a traced call runs, so the calls it
+// makes to the allocator itself are not traced
+__thread int trace_nested;
+
+// While profile_rate is not 0, about one
+// allocation in every profile_rate bytes is
+// sampled: each thread counts down the bytes it
+// allocates, and the allocation that takes its
+// countdown below 0 gets its stack recorded in a
+// Sample. The distance to the next sample is
+// drawn from an exponential distribution, so
+// every byte is equally likely to be sampled
+// whatever the size of the allocation it is in.
+// While profiling is off, a thread only looks at
+// profile_rate again every PROFILE_IDLE_BYTES.
+//
+// Live samples are kept in profile_table by
+// address. A bucket is read without the lock
+// first, so freeing memory that cannot have been
+// sampled costs one load.
+#define PROFILE_BUCKETS (1 << 16)
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_IDLE_BYTES (1 << 20)
+#define PROFILE_POOL_SIZE (64 * 1024)
+
+struct Sample
+{
+  Sample *next;
+  void *ptr;
+  size_t size;
+  unsigned int depth;
+  void *stack[PROFILE_MAX_DEPTH];
+};
+
+size_t profile_rate;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+Sample *profile_table[PROFILE_BUCKETS];
+Sample *profile_free_samples;
+__thread long profile_countdown;
+__thread uint64_t profile_random;
+
+__thread ThreadCache tcache;
+unsigned int tcache_count = TCACHE_DEFAULT_COUNT;
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
 /**
- * Round's a given value up to the next multiple
- * of SIZE_MULTIPLE (which is 8 right now). If a
- * multiple of 8 is given, then that same value is
- * returned.
- * 
- * If the value given is less than MINIMUM_ALLOCATION,
- * MINIMUM_ALLOCATION is returned (which is 16
- * right now).
- * 
+ * Round a requested size up to the data size of
+ * the block that will hold it: header + data is
+ * rounded up to the next multiple of
+ * SIZE_MULTIPLE (which is 16 right now), so a
+ * request for 17 to 24 bytes gets 24 bytes of
+ * data, 25 to 40 bytes gets 40, and so on.
+ *
+ * If the value given is less than
+ * MINIMUM_ALLOCATION, MINIMUM_ALLOCATION is
+ * returned (which is 24 right now).
+ *
  * @param data_size the given value to round up
- * @return the next multiple of SIZE_MULTIPLE that
- * is bigger than data_size
+ * @return the rounded data size
  */
-unsigned int round_up_size(unsigned int data_size)
+size_t round_up_size(size_t data_size)
 {
   if (data_size == 0)
     return 0;
   else if (data_size < MINIMUM_ALLOCATION)
     return MINIMUM_ALLOCATION;
   else
-    return (data_size + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1);
+    return ALIGN_UP(data_size + sizeof(Block), SIZE_MULTIPLE) - sizeof(Block);
 }
 
 /**
@@ -78,293 +654,1665 @@ void *get_data_pointer(Block *block)
 }
 
 /**
- *  Find the next block that is big enough to hold
- *  the given data size.
+ * Get the size of a block's data segment.
  *
- *  Return a pointer to the first free block
- *  available that is at least as big as size.
- *  This does not change the state of the heap at
- *  all. If the block is too big, another function
- *  must handle that.
+ * The owner of a TAKEN block reads this without
+ * any lock while a neighbor may be changing the
+ * block's PREV_FREE flag, hence the atomic load.
  *
- *  @return a pointer to the first free block or
- *          NULL if there are no free blocks
- **/
-Block *find_free_block(uint32_t size)
+ * @param block the block to look at
+ */
+size_t get_data_size(Block *block)
 {
-  // Search through our linked list
-  for (Block *cur = head; cur != NULL; cur = cur->next)
-  {
-    // Return the current block as long as it's
-    // data_size is large enough
-    if (cur->is_free == FREE && cur->data_size >= size)
-    {
-      return cur;
-    }
-  }
-  return NULL;
+  return __atomic_load_n(&block->size_and_flags, __ATOMIC_RELAXED) &
+         ~FLAG_MASK;
 }
 
 /**
- * Create a new block that comes directly after
- * the given block in memory.
+ * Check whether a block is FREE.
  *
- * This function makes sure to update the next and
- * last pointers to maintain correctness in the
- * linked list.
+ * @param block the block to look at
+ */
+int is_free(Block *block) { return block->size_and_flags & FREE; }
+
+/**
+ * Check whether a block has its own mapping.
+ * Safe without a lock, like get_data_size().
  *
- * @param prev_blocK the block we want to add a
- * new block after
- * @param size the data size of the new block
- * @param is_free whether the new block is free or
- * taken
+ * @param block the block to look at
  */
-void add_block_after(Block *prev_block, uint32_t size, uint32_t is_free)
+int is_mapped(Block *block)
 {
-  void *new_pointer =
-      PTR_ADD_BYTES(get_data_pointer(prev_block), prev_block->data_size);
-  Block *new_block = (Block *)new_pointer;
+  return __atomic_load_n(&block->size_and_flags, __ATOMIC_RELAXED) & MAPPED;
+}
 
-  new_block->is_free = is_free;
-  new_block->data_size = size;
-  new_block->last = prev_block;
-  new_block->next = prev_block->next;
+/**
+ * Get the block that follows a block in memory.
+ * Every block has one, since the last block is
+ * always followed by a fence.
+ *
+ * @param block the block to look past
+ */
+Block *next_block(Block *block)
+{
+  return (Block *)PTR_ADD_BYTES(block, sizeof(Block) + get_data_size(block));
+}
 
-  if (prev_block->next != NULL)
-  {
-    prev_block->next->last = new_block;
-  }
-  prev_block->next = new_block;
+/**
+ * Get the block that precedes a block in memory.
+ * Only valid if the block has PREV_FREE set,
+ * since only free blocks have a footer.
+ *
+ * @param block the block to look before
+ */
+Block *prev_block(Block *block)
+{
+  size_t prev_size = *(size_t *)PTR_ADD_BYTES(block, -sizeof(size_t));
+  return (Block *)PTR_ADD_BYTES(block, -(sizeof(Block) + prev_size));
 }
 
 /**
- * Change a given block's size and mark as taken.
+ * Turn a block into a FREE block of a given data
+ * size: write its header and footer and tell the
+ * block after it. The PREV_FREE flag of the
+ * block itself is left alone.
  *
- * If the changed size allows for enough room left
- * over to store the Block struct +
- * MINIMUM_ALLOCATION, split the block into two.
- * Mark the new block as FREE.
+ * @param block the block to mark
+ * @param size its data size
+ */
+void mark_free(Block *block, size_t size)
+{
+  block->size_and_flags = size | FREE | (block->size_and_flags & PREV_FREE);
+  *(size_t *)PTR_ADD_BYTES(block, sizeof(Block) + size - sizeof(size_t)) = size;
+
+  // The next block may be TAKEN, with its owner
+  // reading its size right now
+  __atomic_fetch_or(&next_block(block)->size_and_flags, PREV_FREE,
+                    __ATOMIC_RELAXED);
+}
+
+/**
+ * Turn a block into a TAKEN block of a given data
+ * size and tell the block after it. The
+ * PREV_FREE flag of the block itself is left
+ * alone.
  *
- * @param free_block the block to update as taken,
- * and to split into two if necessary
- * @param size the block to update's new size
+ * @param block the block to mark
+ * @param size its data size
+ */
+void mark_taken(Block *block, size_t size)
+{
+  block->size_and_flags = size | (block->size_and_flags & PREV_FREE);
+  __atomic_fetch_and(&next_block(block)->size_and_flags, ~(size_t)PREV_FREE,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Write a fence: a TAKEN header with a data size
+ * of 0 that ends a stretch of blocks.
+ *
+ * @param fence where the fence goes
+ */
+void set_fence(Block *fence) { fence->size_and_flags = TAKEN; }
+
+/**
+ * Get the free list links stored in a free
+ * block's data segment.
+ *
+ * @param block the free block
  */
-void update_block(Block *free_block, uint32_t size)
+FreeLinks *get_free_links(Block *block)
 {
-  free_block->is_free = TAKEN;
+  return (FreeLinks *)get_data_pointer(block);
+}
 
-  uint32_t size_left_over = free_block->data_size - size;
-  uint32_t minimum_block_size = sizeof(Block) + MINIMUM_ALLOCATION;
-  if (size_left_over <= minimum_block_size)
-  {
-    return;
-  }
-  free_block->data_size = size;
+/**
+ * Map a data size to its size class in
+ * my_malloc_stats_t.
+ *
+ * @param size a data size of at least
+ * SIZE_MULTIPLE
+ * @return the index of the class
+ */
+unsigned int stats_class(size_t size)
+{
+  unsigned int index = 63 - __builtin_clzll(size) - 4;
+  return index < MY_STATS_CLASSES ? index : MY_STATS_CLASSES - 1;
+}
+
+/**
+ * Count a block of an arena in, or out, of its
+ * statistics. Called for every block that is
+ * carved, split off, coalesced away or given
+ * back, and around every size change of a block
+ * that stays.
+ *
+ * @param arena the arena owning the block
+ * @param size the block's data size
+ * @param count 1 to count the block in, -1 to
+ * count it out
+ */
+void count_block(Arena *arena, size_t size, int count)
+{
+  arena->stats.blocks += count;
+  arena->stats.block_bytes += count * (ptrdiff_t)size;
+  arena->stats.blocks_by_class[stats_class(size)] += count;
+}
 
-  uint32_t new_block_data_size = size_left_over - sizeof(Block);
+/**
+ * Count a block of an arena in, or out, of the
+ * free ones, as it goes into or out of a bin.
+ *
+ * @param arena the arena owning the block
+ * @param size the block's data size
+ * @param count 1 to count the block in, -1 to
+ * count it out
+ */
+void count_free_block(Arena *arena, size_t size, int count)
+{
+  arena->stats.free_blocks += count;
+  arena->stats.free_bytes += count * (ptrdiff_t)size;
+  arena->stats.free_by_class[stats_class(size)] += count;
+}
 
-  add_block_after(free_block, new_block_data_size, FREE);
+/**
+ * Read the clock decay is measured by: a coarse
+ * monotonic clock in milliseconds, cheap enough
+ * to read on every free.
+ */
+uint64_t purge_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
 }
 
 /**
- * Add a new block with data_size of size to the
- * linked list of blocks. Works on both an empty
- * and non-empty linked list.
+ * Find the region an address belongs to.
  *
- * @param size the requested data_size
+ * @param ptr any address
+ * @return the region containing ptr, or NULL if
+ * ptr is not in a region (e.g. the sbrk heap)
  */
-Block *add_to_list(uint32_t size)
+Region *region_lookup(void *ptr)
 {
-  // Either head and tail should be NULL, or they
-  // should both not be null
-  if (head == NULL && tail != NULL)
-  {
-    printf("ERROR in add_new_block: head is NULL but tail is not!\n");
-    return NULL;
-  }
-  else if (tail == NULL && head != NULL)
-  {
-    printf("ERROR in add_new_blocK: tail is NULL but head is not!\n");
+  uintptr_t key = (uintptr_t)ptr >> REGION_SHIFT;
+  Region **leaf = region_map[key >> MAP_LEAF_BITS];
+
+  if (leaf == NULL)
     return NULL;
-  }
+  return leaf[key & (MAP_LEAF_SIZE - 1)];
+}
 
-  // Expand our heap
-  void *memory_address = sbrk(sizeof(Block) + size);
+/**
+ * Get the decay list links stored in a big free
+ * block's data segment.
+ *
+ * @param block a FREE block of at least
+ * PURGE_MIN_SIZE bytes
+ */
+PurgeLinks *get_purge_links(Block *block)
+{
+  return (PurgeLinks *)PTR_ADD_BYTES(get_data_pointer(block),
+                                     PURGE_LINKS_OFFSET);
+}
+
+/**
+ * Find the whole pages of a big free block that
+ * can be purged: all of them but those holding
+ * its links and its footer. In a huge page
+ * region these are huge pages.
+ *
+ * @param block a FREE block of at least
+ * PURGE_MIN_SIZE bytes
+ * @param start where to store the first page
+ * @return the number of bytes from start on
+ */
+size_t purge_range(Block *block, char **start)
+{
+  Region *region = region_lookup(block);
+  uintptr_t page_size = region != NULL && region->huge
+                            ? HUGE_PAGE_SIZE
+                            : (uintptr_t)sysconf(_SC_PAGESIZE);
+  char *data = get_data_pointer(block);
+  char *first = (char *)ALIGN_UP(
+      data + PURGE_LINKS_OFFSET + sizeof(PurgeLinks), page_size);
+  char *end = (char *)((uintptr_t)(data + get_data_size(block) -
+                                   sizeof(size_t)) &
+                       ~(page_size - 1));
 
-  // Create a new block where we've expanded the
-  // heap
-  Block *prev_tail = tail;
-  tail = (Block *)memory_address;
-  tail->data_size = size;
-  tail->is_free = TAKEN;
-  tail->next = NULL;
+  *start = first;
+  return end > first ? end - first : 0;
+}
 
-  // If tail is NULL, head should also be NULL.
-  // This means our linked list of blocks has size
-  // 0
-  if (prev_tail == NULL)
-  {
-    // Set our head and tail pointers to point to
-    // the newly allocated block of memory
-    head = (Block *)memory_address;
-    tail->last = NULL;
-    // set the value of head to be the newly
-    // created block
-  }
-  else
-  {
-    // Update the next/last pointers to maintain
-    // correctness of the linked list
-    tail->last = prev_tail;
-    prev_tail->next = tail;
-  }
+/**
+ * Start the decay of a free block going into a
+ * bin: it counts as freed just now and goes on
+ * its arena's decay list. Blocks below
+ * PURGE_MIN_SIZE never decay.
+ *
+ * @param arena the arena owning the block
+ * @param block the FREE block
+ */
+void decay_add(Arena *arena, Block *block)
+{
+  if (get_data_size(block) < PURGE_MIN_SIZE)
+    return;
 
-  return tail;
+  PurgeLinks *links = get_purge_links(block);
+  links->freed_at = purge_clock();
+  links->purged = 0;
+  links->prev = NULL;
+  links->next = arena->decay_list;
+  if (arena->decay_list != NULL)
+    get_purge_links(arena->decay_list)->prev = block;
+  arena->decay_list = block;
 }
 
 /**
- * Remove a block from the linked list data
- * structure.
+ * Take a free block that is leaving its bin off
+ * the decay list, or out of the purged bytes if
+ * its pages are gone already.
  *
- * @param block the block to remove from the
- * linked list data structure
+ * @param arena the arena owning the block
+ * @param block the FREE block
  */
-void remove_from_list(Block *block)
+void decay_remove(Arena *arena, Block *block)
 {
-  // Unlink ourselves
-  if (block->last != NULL)
-  {
-    block->last->next = block->next;
-  }
+  if (get_data_size(block) < PURGE_MIN_SIZE)
+    return;
 
-  if (block->next != NULL)
+  PurgeLinks *links = get_purge_links(block);
+  if (links->purged)
   {
-    block->next->last = block->last;
+    char *start;
+    arena->stats.purged_bytes -= purge_range(block, &start);
+    return;
   }
 
-  if (block == head)
-  {
-    head = block->next;
-  }
+  if (links->prev != NULL)
+    get_purge_links(links->prev)->next = links->next;
+  else
+    arena->decay_list = links->next;
 
-  if (block == tail)
-  {
-    tail = block->last;
-  }
+  if (links->next != NULL)
+    get_purge_links(links->next)->prev = links->prev;
 }
 
 /**
- * Simple wrapper for called brk().
+ * Take a free block on the decay list off it and
+ * count its pages as purged.
  *
- * @param block the starting memory address to
- * relinquish to the OS
+ * @param arena the arena owning the block
+ * @param block a FREE block on the decay list
+ * @param start where to store the first page
+ * purged
+ * @return the number of bytes from start on
  */
-void contract_heap(Block *block) { brk(block); }
+size_t mark_purged(Arena *arena, Block *block, char **start)
+{
+  decay_remove(arena, block);
+  get_purge_links(block)->purged = 1;
 
-/**
- * Print the address of our head and tail
- * pointers. A helper function for debugging
- * purposes.
- */
-void print_head_and_tail() { printf("HEAD: %p\nTAIL: %p\n", head, tail); }
+  size_t length = purge_range(block, start);
+  arena->stats.purged_bytes += length;
+  return length;
+}
 
 /**
- * Print the attributes of a given Block data
- * structure. A helper function for debugging
- * purposes.
+ * Purge the pages of a free block on the decay
+ * list. Purged pages read back as zero once they
+ * are touched again.
  *
- * @param block the block to print
+ * @param arena the arena owning the block
+ * @param block a FREE block on the decay list
  */
-void print_block(Block *block)
+void purge_block(Arena *arena, Block *block)
 {
-  printf("LAST: %p, THIS: %p, NEXT: %p, FREE?: %u, DATA_SIZE: %u\n",
-         block->last, block, block->next, block->is_free, block->data_size);
+  char *start;
+  size_t length = mark_purged(arena, block, &start);
+  madvise(start, length, MADV_DONTNEED);
 }
 
 /**
- * Print the entire linked list of blocks. Helper
- * function for debugging purposes.
+ * Carry the decay of the free memory a block was
+ * made from over to the block, which
+ * add_to_bin() took to be freed just now.
+ *
+ * @param arena the arena owning the block
+ * @param block a FREE block just put in a bin
+ * @param freed_at when its memory was freed, in
+ * the terms of purge_clock()
+ * @param purged whether its pages are purged
+ * already
  */
-void print_linked_list()
+void decay_inherit(Arena *arena, Block *block, uint64_t freed_at, int purged)
 {
-  for (Block *cur = head; cur != NULL; cur = cur->next)
-  {
-    print_block(cur);
-  }
+  if (get_data_size(block) < PURGE_MIN_SIZE)
+    return;
+
+  // Only the pages the block's header and links
+  // were just written to are back. They stay, so
+  // that carving from a purged block does not
+  // cost a system call every time.
+  char *start;
+  if (purged)
+    mark_purged(arena, block, &start);
+  else
+    get_purge_links(block)->freed_at = freed_at;
 }
 
 /**
- * Special coalesce case for combining two
- * adjacent blocks into one. Specifically,
- * combines the right block with the block on its
- * left.
+ * Add a free block about to be coalesced into
+ * another to the resident memory coalesce()
+ * tallies. Blocks too small to decay count as
+ * freed just now, purged ones not at all.
  *
- * @param block the block to remove and combine
- * with its block to the left
+ * @param block the FREE block
+ * @param now the time of the coalescing
+ * @param dirty_bytes the resident bytes so far
+ * @param weighted_age the sum of the age of each
+ * resident byte so far, in milliseconds
  */
-Block *remove_block(Block *block)
+void decay_merge(Block *block, uint64_t now, double *dirty_bytes,
+                 double *weighted_age)
 {
-  if (block->next != NULL)
+  size_t size = get_data_size(block);
+  if (size < PURGE_MIN_SIZE)
   {
-    block->last->next = block->next;
-    block->next->last = block->last;
+    *dirty_bytes += size;
+    return;
   }
-  else
+
+  PurgeLinks *links = get_purge_links(block);
+  if (!links->purged)
   {
-    tail = block->last;
-    block->last->next = NULL;
+    *dirty_bytes += size;
+    *weighted_age += (double)(now - links->freed_at) * size;
   }
-  block->last->data_size =
-      block->last->data_size + sizeof(Block) + block->data_size;
-  return block->last;
 }
 
 /**
- * Combine a block with its left and right
- * neighbors depending on if the neighbors are
- * free.
+ * Purge the free blocks that have stayed free for
+ * purge_decay_ms. The whole decay list is looked
+ * at, but at most PURGE_SWEEPS times per decay
+ * period. The caller holds the arena's lock.
+ *
+ * @param arena the arena to purge
  */
-Block *coalesce(Block *block)
+void purge_decayed(Arena *arena)
 {
-  // If the block to the left is free, combine
-  if (block->last != NULL && block->last->is_free == FREE)
-  {
-    block = remove_block(block);
-  }
+  long decay_ms = purge_decay_ms;
+  if (decay_ms < 0 || arena->decay_list == NULL)
+    return;
 
-  // If the block to the right is free, combine
-  if (block->next != NULL && block->next->is_free == FREE)
+  uint64_t now = purge_clock();
+  if (now - arena->last_sweep < (uint64_t)decay_ms / PURGE_SWEEPS)
+    return;
+  arena->last_sweep = now;
+
+  Block *block = arena->decay_list;
+  while (block != NULL)
   {
-    block = remove_block(block->next);
+    Block *next = get_purge_links(block)->next;
+    if (now - get_purge_links(block)->freed_at >= (uint64_t)decay_ms)
+      purge_block(arena, block);
+    block = next;
   }
+}
 
-  return block;
+#ifndef MYMALLOC_TLSF
+
+/**
+ * Map a data size to the bin holding free blocks
+ * of that size. Every size has a bin of its own.
+ *
+ * @param size a data size below TREE_MIN_SIZE,
+ * already rounded by round_up_size()
+ * @return the index of the bin for size
+ */
+unsigned int bin_index(size_t size)
+{
+  return size / SIZE_MULTIPLE;
 }
 
 /**
- * Allocate memory of a given size.
+ * Get the tree links stored in a large free
+ * block.
  *
- * @param size the number of bytes to allocate
- * @return a void pointer pointing to the newly
- * allocated memory
+ * @param block a FREE block of at least
+ * TREE_MIN_SIZE bytes
  */
-void *my_malloc(unsigned int size)
+TreeNode *get_tree_node(Block *block)
 {
-  if (size == 0)
-    return NULL;
+  return (TreeNode *)get_data_pointer(block);
+}
 
-  // Ensure our size is correctly aligned.
-  // In other words, a request for 17 bytes is
-  // rounded up to 24. A request for 25 bytes is
-  // rounded up to 32. 34 is rounded to 40. etc.
-  // Anything below 16 bytes is rounded to 16
-  size = round_up_size(size);
+/**
+ * Get the height of a subtree.
+ *
+ * @param block the root of the subtree, or NULL
+ * @return 0 for an empty subtree
+ */
+size_t tree_height(Block *block)
+{
+  return block != NULL ? get_tree_node(block)->height : 0;
+}
 
-  // First fit algorithm tries to find the first
-  // free block that could fit our requested size
-  Block *free_block = find_free_block(size);
+/**
+ * Order free blocks in the tree: by size, then by
+ * address, so the best fit found is also the
+ * lowest one in memory among equal sizes.
+ *
+ * @param a a block
+ * @param b another block
+ * @return whether a comes before b
+ */
+int tree_less(Block *a, Block *b)
+{
+  size_t a_size = get_data_size(a);
+  size_t b_size = get_data_size(b);
+  return a_size < b_size || (a_size == b_size && a < b);
+}
 
-  // If we've found a free block, then we should
+/**
+ * Restore the AVL balance of a subtree whose
+ * children are balanced and differ in height by
+ * at most two, with at most two rotations.
+ *
+ * @param block the root of the subtree
+ * @return the new root of the subtree
+ */
+Block *tree_balance(Block *block)
+{
+  TreeNode *node = get_tree_node(block);
+  size_t left = tree_height(node->left);
+  size_t right = tree_height(node->right);
+
+  if (left > right + 1)
+  {
+    // Rotate right, first rotating the left child
+    // left if its inner subtree is the taller one
+    Block *pivot = node->left;
+    TreeNode *pivot_node = get_tree_node(pivot);
+    if (tree_height(pivot_node->right) > tree_height(pivot_node->left))
+    {
+      node->left = pivot_node->right;
+      pivot_node->right = get_tree_node(node->left)->left;
+      get_tree_node(node->left)->left = tree_balance(pivot);
+      pivot = node->left;
+      pivot_node = get_tree_node(pivot);
+    }
+    node->left = pivot_node->right;
+    pivot_node->right = tree_balance(block);
+    return tree_balance(pivot);
+  }
+
+  if (right > left + 1)
+  {
+    // The mirror image of the above
+    Block *pivot = node->right;
+    TreeNode *pivot_node = get_tree_node(pivot);
+    if (tree_height(pivot_node->left) > tree_height(pivot_node->right))
+    {
+      node->right = pivot_node->left;
+      pivot_node->left = get_tree_node(node->right)->right;
+      get_tree_node(node->right)->right = tree_balance(pivot);
+      pivot = node->right;
+      pivot_node = get_tree_node(pivot);
+    }
+    node->right = pivot_node->left;
+    pivot_node->left = tree_balance(block);
+    return tree_balance(pivot);
+  }
+
+  node->height = (left > right ? left : right) + 1;
+  return block;
+}
+
+/**
+ * Insert a free block into a subtree.
+ *
+ * @param root the root of the subtree, or NULL
+ * @param block the block to insert, not in any
+ * tree
+ * @return the new root of the subtree
+ */
+Block *tree_insert(Block *root, Block *block)
+{
+  if (root == NULL)
+  {
+    TreeNode *node = get_tree_node(block);
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    return block;
+  }
+
+  TreeNode *node = get_tree_node(root);
+  if (tree_less(block, root))
+    node->left = tree_insert(node->left, block);
+  else
+    node->right = tree_insert(node->right, block);
+  return tree_balance(root);
+}
+
+/**
+ * Take the smallest block out of a subtree.
+ *
+ * @param root the root of a non-empty subtree
+ * @param min where to store the block taken out
+ * @return the new root of the subtree
+ */
+Block *tree_remove_min(Block *root, Block **min)
+{
+  TreeNode *node = get_tree_node(root);
+  if (node->left == NULL)
+  {
+    *min = root;
+    return node->right;
+  }
+
+  node->left = tree_remove_min(node->left, min);
+  return tree_balance(root);
+}
+
+/**
+ * Take a free block out of a subtree.
+ *
+ * @param root the root of the subtree holding
+ * block
+ * @param block the block to remove
+ * @return the new root of the subtree
+ */
+Block *tree_remove(Block *root, Block *block)
+{
+  TreeNode *node = get_tree_node(root);
+
+  if (root == block)
+  {
+    if (node->left == NULL)
+      return node->right;
+    if (node->right == NULL)
+      return node->left;
+
+    // Replace the block with its successor
+    Block *successor;
+    Block *right = tree_remove_min(node->right, &successor);
+    get_tree_node(successor)->left = node->left;
+    get_tree_node(successor)->right = right;
+    return tree_balance(successor);
+  }
+
+  if (tree_less(block, root))
+    node->left = tree_remove(node->left, block);
+  else
+    node->right = tree_remove(node->right, block);
+  return tree_balance(root);
+}
+
+/**
+ * Find the smallest free block in an arena's tree
+ * that can hold a given data size, the lowest in
+ * memory among equal sizes.
+ *
+ * @param arena the arena to search
+ * @param size the data size needed
+ * @return the best fitting block, or NULL if
+ * none is big enough
+ */
+Block *tree_best_fit(Arena *arena, size_t size)
+{
+  Block *best = NULL;
+  Block *block = arena->tree;
+
+  while (block != NULL)
+  {
+    if (get_data_size(block) >= size)
+    {
+      best = block;
+      block = get_tree_node(block)->left;
+    }
+    else
+    {
+      block = get_tree_node(block)->right;
+    }
+  }
+  return best;
+}
+
+/**
+ * Push a free block onto the front of its bin, or
+ * insert it into the tree if it is too big for
+ * the bins.
+ *
+ * @param arena the arena owning the block
+ * @param block the FREE block to add
+ */
+void add_to_bin(Arena *arena, Block *block)
+{
+  count_free_block(arena, get_data_size(block), 1);
+  decay_add(arena, block);
+
+  if (get_data_size(block) >= TREE_MIN_SIZE)
+  {
+    arena->tree = tree_insert(arena->tree, block);
+    return;
+  }
+
+  unsigned int index = bin_index(get_data_size(block));
+  FreeLinks *links = get_free_links(block);
+
+  links->last_free = NULL;
+  links->next_free = arena->bins[index];
+  if (arena->bins[index] != NULL)
+  {
+    get_free_links(arena->bins[index])->last_free = block;
+  }
+  arena->bins[index] = block;
+  arena->bin_map |= (uint64_t)1 << index;
+}
+
+/**
+ * Unlink a free block from its bin or the tree.
+ * Must be called before the block's size changes
+ * or it stops being FREE.
+ *
+ * @param arena the arena owning the block
+ * @param block the FREE block to remove
+ */
+void remove_from_bin(Arena *arena, Block *block)
+{
+  count_free_block(arena, get_data_size(block), -1);
+  decay_remove(arena, block);
+
+  if (get_data_size(block) >= TREE_MIN_SIZE)
+  {
+    arena->tree = tree_remove(arena->tree, block);
+    return;
+  }
+
+  FreeLinks *links = get_free_links(block);
+
+  if (links->last_free != NULL)
+  {
+    get_free_links(links->last_free)->next_free = links->next_free;
+  }
+  else
+  {
+    unsigned int index = bin_index(get_data_size(block));
+    arena->bins[index] = links->next_free;
+    if (links->next_free == NULL)
+      arena->bin_map &= ~((uint64_t)1 << index);
+  }
+
+  if (links->next_free != NULL)
+  {
+    get_free_links(links->next_free)->last_free = links->last_free;
+  }
+}
+
+/**
+ *  Find a free block that is big enough to hold
+ *  the given data size.
+ *
+ *  Only the bins and the tree are searched, so
+ *  blocks that are in use are never touched.
+ *  Every block in a bin is exactly the bin's
+ *  size, so the first block of the request's own
+ *  bin, or else of the next non-empty bin, is
+ *  taken, found with one look at bin_map. No bin
+ *  is ever walked. Failing that, the best fit in
+ *  the tree is. Sizes too big for the bins only
+ *  look at the tree. This does not change the
+ *  state of the heap at all. If the block is too
+ *  big, another function must handle that.
+ *
+ *  @param arena the arena to search
+ *  @param size the data size needed
+ *  @return a pointer to a free block or NULL if
+ *          there are no free blocks large enough
+ **/
+Block *find_free_block(Arena *arena, size_t size)
+{
+  if (size >= TREE_MIN_SIZE)
+    return tree_best_fit(arena, size);
+
+  // Everything in the request's bin or a bigger
+  // one is big enough, and the lowest set bit
+  // from index up is the smallest such bin that
+  // is not empty
+  uint64_t fits = arena->bin_map & (~(uint64_t)0 << bin_index(size));
+  if (fits != 0)
+    return arena->bins[__builtin_ctzll(fits)];
+
+  return tree_best_fit(arena, size);
+}
+
+/**
+ * Find the data size of the biggest free block
+ * of an arena: the rightmost node of the tree,
+ * or else the size of the highest bin that is
+ * not empty.
+ *
+ * @param arena the arena to search
+ * @return the data size, or 0 if the arena has
+ * no free block
+ */
+size_t largest_free_block(Arena *arena)
+{
+  Block *block = arena->tree;
+  if (block != NULL)
+  {
+    while (get_tree_node(block)->right != NULL)
+    {
+      block = get_tree_node(block)->right;
+    }
+    return get_data_size(block);
+  }
+
+  if (arena->bin_map == 0)
+    return 0;
+
+  return get_data_size(arena->bins[63 - __builtin_clzll(arena->bin_map)]);
+}
+
+#else
+
+/**
+ * Map a data size to the TLSF list holding free
+ * blocks of that size.
+ *
+ * @param size a data size
+ * @param fl where to store the first level index
+ * @param sl where to store the second level index
+ */
+void tlsf_mapping(size_t size, unsigned int *fl, unsigned int *sl)
+{
+  if (size < TLSF_SMALL_SIZE)
+  {
+    *fl = 0;
+    *sl = size / SIZE_MULTIPLE;
+    return;
+  }
+
+  unsigned int log2 = 63 - __builtin_clzll(size);
+  *fl = log2 - TLSF_FL_SHIFT + 1;
+  *sl = (size >> (log2 - TLSF_SL_SHIFT)) - TLSF_SL_COUNT;
+}
+
+/**
+ * Push a free block onto the front of its TLSF
+ * list.
+ *
+ * @param arena the arena owning the block
+ * @param block the FREE block to add
+ */
+void add_to_bin(Arena *arena, Block *block)
+{
+  count_free_block(arena, get_data_size(block), 1);
+  decay_add(arena, block);
+
+  unsigned int fl, sl;
+  tlsf_mapping(get_data_size(block), &fl, &sl);
+
+  Block **list = &arena->tlsf_lists[fl][sl];
+  FreeLinks *links = get_free_links(block);
+
+  links->last_free = NULL;
+  links->next_free = *list;
+  if (*list != NULL)
+  {
+    get_free_links(*list)->last_free = block;
+  }
+  *list = block;
+
+  arena->tlsf_fl_map |= (uint64_t)1 << fl;
+  arena->tlsf_sl_map[fl] |= 1U << sl;
+}
+
+/**
+ * Unlink a free block from its TLSF list. Must be
+ * called before the block's size changes or it
+ * stops being FREE.
+ *
+ * @param arena the arena owning the block
+ * @param block the FREE block to remove
+ */
+void remove_from_bin(Arena *arena, Block *block)
+{
+  count_free_block(arena, get_data_size(block), -1);
+  decay_remove(arena, block);
+
+  FreeLinks *links = get_free_links(block);
+
+  if (links->last_free != NULL)
+  {
+    get_free_links(links->last_free)->next_free = links->next_free;
+  }
+  else
+  {
+    unsigned int fl, sl;
+    tlsf_mapping(get_data_size(block), &fl, &sl);
+
+    arena->tlsf_lists[fl][sl] = links->next_free;
+    if (links->next_free == NULL)
+    {
+      arena->tlsf_sl_map[fl] &= ~(1U << sl);
+      if (arena->tlsf_sl_map[fl] == 0)
+        arena->tlsf_fl_map &= ~((uint64_t)1 << fl);
+    }
+  }
+
+  if (links->next_free != NULL)
+  {
+    get_free_links(links->next_free)->last_free = links->last_free;
+  }
+}
+
+/**
+ *  Find a free block that is big enough to hold
+ *  the given data size, in constant time.
+ *
+ *  The first block of the size's own list is
+ *  taken if it is big enough, so memory freed and
+ *  asked for again at one size is reused. Else
+ *  the size is rounded up to the start of the
+ *  next TLSF list, so that every block in that
+ *  list and all later ones is big enough. The
+ *  second level bitmap of the size's power of two
+ *  finds the first such list that is not empty,
+ *  or failing that the first level bitmap finds
+ *  the next power of two with any free block.
+ *  Blocks inside a list are never looked at, so
+ *  the first one is taken. This does not change
+ *  the state of the heap at all.
+ *
+ *  @param arena the arena to search
+ *  @param size the data size needed
+ *  @return a pointer to a free block or NULL if
+ *          there are no free blocks large enough
+ **/
+Block *find_free_block(Arena *arena, size_t size)
+{
+  unsigned int fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+
+  // Lists below TLSF_SMALL_SIZE hold one size
+  // each; in the others only the head is looked
+  // at, so the time stays constant
+  Block *head = arena->tlsf_lists[fl][sl];
+  if (head != NULL && get_data_size(head) >= size)
+    return head;
+
+  if (size >= TLSF_SMALL_SIZE)
+  {
+    unsigned int log2 = 63 - __builtin_clzll(size);
+    size += ((size_t)1 << (log2 - TLSF_SL_SHIFT)) - 1;
+    tlsf_mapping(size, &fl, &sl);
+  }
+
+  unsigned int sl_map = arena->tlsf_sl_map[fl] & (~0U << sl);
+  if (sl_map == 0)
+  {
+    uint64_t fl_map = arena->tlsf_fl_map & (~(uint64_t)0 << (fl + 1));
+    if (fl_map == 0)
+      return NULL;
+
+    fl = __builtin_ctzll(fl_map);
+    sl_map = arena->tlsf_sl_map[fl];
+  }
+  return arena->tlsf_lists[fl][__builtin_ctz(sl_map)];
+}
+
+/**
+ * Find the data size of the biggest free block
+ * of an arena by walking the highest TLSF list
+ * that is not empty.
+ *
+ * @param arena the arena to search
+ * @return the data size, or 0 if the arena has
+ * no free block
+ */
+size_t largest_free_block(Arena *arena)
+{
+  if (arena->tlsf_fl_map == 0)
+    return 0;
+
+  unsigned int fl = 63 - __builtin_clzll(arena->tlsf_fl_map);
+  unsigned int sl = 31 - __builtin_clz(arena->tlsf_sl_map[fl]);
+  size_t largest = 0;
+  for (Block *block = arena->tlsf_lists[fl][sl]; block != NULL;
+       block = get_free_links(block)->next_free)
+  {
+    if (get_data_size(block) > largest)
+      largest = get_data_size(block);
+  }
+  return largest;
+}
+
+#endif
+
+/**
+ * Create a new block that comes directly after
+ * the given block in memory, in space that used
+ * to belong to the given block.
+ *
+ * @param arena the arena owning prev_block
+ * @param prev_blocK the block we want to add a
+ * new block after
+ * @param size the data size of the new block
+ * @param is_free whether the new block is free or
+ * taken
+ */
+void add_block_after(Arena *arena, Block *prev_block, size_t size,
+                     uint32_t is_free)
+{
+  Block *new_block = next_block(prev_block);
+
+  // The block before it is prev_block, which is
+  // never FREE when it is being split
+  new_block->size_and_flags = TAKEN;
+  if (is_free == FREE)
+  {
+    mark_free(new_block, size);
+    add_to_bin(arena, new_block);
+  }
+  else
+  {
+    mark_taken(new_block, size);
+  }
+  count_block(arena, size, 1);
+}
+
+/**
+ * Change a given block's size and mark as taken.
+ *
+ * If the changed size allows for enough room left
+ * over to store the Block struct +
+ * MINIMUM_ALLOCATION, split the block into two.
+ * Mark the new block as FREE and put it in its
+ * bin. The given block is taken out of its bin.
+ *
+ * @param arena the arena owning free_block
+ * @param free_block the block to update as taken,
+ * and to split into two if necessary
+ * @param size the block to update's new size
+ */
+void update_block(Arena *arena, Block *free_block, size_t size)
+{
+  size_t data_size = get_data_size(free_block);
+  uint64_t freed_at = 0;
+  int purged = 0;
+  if (data_size >= PURGE_MIN_SIZE)
+  {
+    freed_at = get_purge_links(free_block)->freed_at;
+    purged = get_purge_links(free_block)->purged;
+  }
+
+  remove_from_bin(arena, free_block);
+
+  size_t size_left_over = data_size - size;
+  size_t minimum_block_size = sizeof(Block) + MINIMUM_ALLOCATION;
+  if (size_left_over < minimum_block_size)
+  {
+    mark_taken(free_block, data_size);
+    return;
+  }
+
+  // The block after free_block keeps its
+  // PREV_FREE flag: its new neighbor is free too
+  free_block->size_and_flags = size | (free_block->size_and_flags & PREV_FREE);
+  count_block(arena, data_size, -1);
+  count_block(arena, size, 1);
+
+  size_t new_block_data_size = size_left_over - sizeof(Block);
+
+  // What is left over has been free as long as
+  // free_block has
+  add_block_after(arena, free_block, new_block_data_size, FREE);
+  decay_inherit(arena, next_block(free_block), freed_at, purged);
+}
+
+/**
+ * Map size bytes aligned to REGION_SIZE, so the
+ * mapping covers whole region_map slots.
+ *
+ * @param size the number of bytes to map, a
+ * multiple of REGION_SIZE
+ * @param huge whether to ask for transparent huge
+ * pages
+ * @param node the NUMA node to prefer, -1 for
+ * whichever first touches each page
+ * @return the start of the mapping, or NULL if
+ * the OS refused
+ */
+void *map_aligned(size_t size, int huge, int node)
+{
+  // Over-map by one region and trim the ends so
+  // what's left starts on a REGION_SIZE boundary
+  size_t span = size + REGION_SIZE;
+  char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+
+  char *aligned = (char *)ALIGN_UP(raw, REGION_SIZE);
+  if (aligned != raw)
+    munmap(raw, aligned - raw);
+  if (raw + span != aligned + size)
+    munmap(aligned + size, raw + span - (aligned + size));
+
+  // Only a hint: without THP in the kernel the
+  // region just keeps small pages
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+  // Before anything touches it. Preferred, not
+  // bound, so a full node falls back to another
+  // instead of failing.
+  if (node >= 0)
+  {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, aligned, size, MPOL_PREFERRED, &mask,
+            sizeof(mask) * CHAR_BIT, 0);
+  }
+  return aligned;
+}
+
+/**
+ * Point every region_map slot covered by a
+ * region at value.
+ *
+ * @param region the region to (un)register
+ * @param value the region itself to register it,
+ * NULL to unregister it
+ * @return 0 on success, -1 if a leaf of the map
+ * could not be allocated
+ */
+int set_region_map(Region *region, Region *value)
+{
+  uintptr_t first = (uintptr_t)region >> REGION_SHIFT;
+  uintptr_t count = region->size >> REGION_SHIFT;
+
+  pthread_mutex_lock(&region_map_lock);
+  for (uintptr_t key = first; key < first + count; key++)
+  {
+    Region ***leaf = &region_map[key >> MAP_LEAF_BITS];
+    if (*leaf == NULL)
+    {
+      void *memory = mmap(NULL, MAP_LEAF_SIZE * sizeof(Region *),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED)
+      {
+        pthread_mutex_unlock(&region_map_lock);
+        return -1;
+      }
+      *leaf = (Region **)memory;
+    }
+    (*leaf)[key & (MAP_LEAF_SIZE - 1)] = value;
+  }
+  pthread_mutex_unlock(&region_map_lock);
+  return 0;
+}
+
+/**
+ * Find the arena a block or slab object belongs
+ * to.
+ *
+ * @param ptr a block or an object handed out by
+ * any arena
+ */
+Arena *arena_of(void *ptr)
+{
+  Region *region = region_lookup(ptr);
+  return region != NULL ? region->arena : &main_arena;
+}
+
+/**
+ * Find the slab an address belongs to, if any.
+ *
+ * @param ptr any address handed out by the
+ * allocator
+ * @return the slab holding ptr, or NULL if ptr is
+ * the data of a block
+ */
+Slab *slab_of(void *ptr)
+{
+  Region *region = region_lookup(ptr);
+  if (region == NULL || !region->is_slab)
+    return NULL;
+  return (Slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+/**
+ * Find where the first block after an address
+ * has to start so that its data is aligned.
+ *
+ * @param address the first byte the block may
+ * use
+ */
+Block *first_block_at(void *address)
+{
+  return (Block *)(ALIGN_UP(PTR_ADD_BYTES(address, sizeof(Block)),
+                            SIZE_MULTIPLE) -
+                   sizeof(Block));
+}
+
+/**
+ * Map and register a new region big enough to
+ * carve at least min_size bytes from.
+ *
+ * @param min_size the number of bytes needed
+ * after the Region struct
+ * @param node the NUMA node to prefer, -1 for
+ * any
+ * @return the new region, with no arena set yet,
+ * or NULL if the OS refused
+ */
+Region *map_region(size_t min_size, int node)
+{
+  // Leave room to align the first block and for
+  // the fence at the end
+  int huge = huge_pages;
+  size_t size = ALIGN_UP(sizeof(Region) + SIZE_MULTIPLE + min_size +
+                             sizeof(Block),
+                         huge ? HUGE_REGION_SIZE : REGION_SIZE);
+  Region *region = (Region *)map_aligned(size, huge, node);
+  if (region == NULL)
+    return NULL;
+
+  region->arena = NULL;
+  region->next = NULL;
+  region->size = size;
+  region->first = first_block_at(region + 1);
+  region->top = region->first;
+  region->clean = (char *)region->first;
+  region->huge = huge;
+  set_fence(region->top);
+
+  if (set_region_map(region, region) != 0)
+  {
+    munmap(region, size);
+    return NULL;
+  }
+  return region;
+}
+
+/**
+ * Get how many bytes can still be carved from a
+ * region, headers included, while leaving room
+ * for the fence.
+ *
+ * @param region the region to look at
+ */
+size_t region_space(Region *region)
+{
+  return (char *)region + region->size - (char *)region->top - sizeof(Block);
+}
+
+/**
+ * Turn a fence into a TAKEN block of a given data
+ * size and put a new fence after it. The caller
+ * makes sure the memory is there.
+ *
+ * @param arena the arena the fence belongs to
+ * @param fence the fence to replace
+ * @param size the data size of the new block
+ * @return the new block, which starts where the
+ * fence was
+ */
+Block *extend_at_fence(Arena *arena, Block *fence, size_t size)
+{
+  // Keep PREV_FREE: the block before the fence
+  // is now the block before the new block
+  fence->size_and_flags = size | (fence->size_and_flags & PREV_FREE);
+  set_fence(next_block(fence));
+  count_block(arena, size, 1);
+  return fence;
+}
+
+/**
+ * Combine a block with its left and right
+ * neighbors depending on if the neighbors are
+ * free, and mark the result FREE. Neighbors are
+ * taken out of their bins before they are
+ * absorbed. The returned block is not in any
+ * bin.
+ *
+ * @param arena the arena owning the block
+ * @param block the block to free and coalesce
+ * @param freed_at if not NULL, set to when the
+ * result counts as freed: the average time its
+ * resident bytes were freed at, so that a block
+ * freed next to one that has been decaying for a
+ * while neither resets its decay nor is purged
+ * right away
+ */
+Block *coalesce(Arena *arena, Block *block, uint64_t *freed_at)
+{
+  size_t size = get_data_size(block);
+  count_block(arena, size, -1);
+
+  uint64_t now = purge_clock();
+  double dirty_bytes = size;
+  double weighted_age = 0;
+
+  // If the block to the left is free, combine
+  if (block->size_and_flags & PREV_FREE)
+  {
+    Block *prev = prev_block(block);
+    decay_merge(prev, now, &dirty_bytes, &weighted_age);
+    remove_from_bin(arena, prev);
+    count_block(arena, get_data_size(prev), -1);
+    size += sizeof(Block) + get_data_size(prev);
+    block = prev;
+  }
+
+  // If the block to the right is free, combine
+  Block *next = (Block *)PTR_ADD_BYTES(block, sizeof(Block) + size);
+  if (is_free(next))
+  {
+    decay_merge(next, now, &dirty_bytes, &weighted_age);
+    remove_from_bin(arena, next);
+    count_block(arena, get_data_size(next), -1);
+    size += sizeof(Block) + get_data_size(next);
+  }
+
+  mark_free(block, size);
+  count_block(arena, size, 1);
+  if (freed_at != NULL)
+    *freed_at = now - (uint64_t)(weighted_age / dirty_bytes);
+  return block;
+}
+
+/**
+ * Note that a block just carved from the top of a
+ * stretch of blocks is in use, moving the
+ * stretch's clean mark past it and the fence
+ * after it, whose flags can change.
+ *
+ * @param clean the clean mark of the stretch
+ * @param block the block just carved
+ * @return how many bytes at the start of the
+ * block's data may have been written to before
+ */
+size_t claim_clean(char **clean, Block *block)
+{
+  char *data = get_data_pointer(block);
+  char *end = (char *)next_block(block) + sizeof(Block);
+  size_t dirty = 0;
+
+  if (*clean > data)
+    dirty = (*clean < end ? *clean : end) - data;
+  if (*clean < end)
+    *clean = end;
+  return dirty;
+}
+
+/**
+ * Start a new region for a non-main arena.
+ *
+ * Whatever is left at the top of the current
+ * region is turned into a free block first, since
+ * blocks are only ever carved from the newest
+ * region.
+ *
+ * @param arena the arena to grow
+ * @param min_size the number of bytes that must
+ * be available to carve
+ * @return the new region or NULL if the OS
+ * refused
+ */
+Region *add_region(Arena *arena, size_t min_size)
+{
+  Region *current = arena->regions;
+  if (current != NULL)
+  {
+    size_t left_over = region_space(current);
+    if (left_over >= sizeof(Block) + MINIMUM_ALLOCATION)
+    {
+      Block *block = extend_at_fence(arena, current->top,
+                                     left_over - sizeof(Block));
+      current->top = next_block(block);
+      claim_clean(&current->clean, block);
+      add_to_bin(arena, coalesce(arena, block, NULL));
+    }
+  }
+
+  Region *region = map_region(min_size, arena->node);
+  if (region == NULL)
+    return NULL;
+
+  region->arena = arena;
+  region->next = arena->regions;
+  arena->regions = region;
+  return region;
+}
+
+/**
+ * Check whether the top of an arena is the sbrk
+ * heap. Once the main arena has mapped a region
+ * its sbrk heap no longer grows or shrinks.
+ *
+ * @param arena the arena to look at
+ */
+int uses_sbrk(Arena *arena)
+{
+  return arena == &main_arena && arena->regions == NULL;
+}
+
+/**
+ * Add a new TAKEN block with data_size of size at
+ * the top of an arena.
+ *
+ * The main arena asks the OS for more heap with
+ * sbrk(), a chunk at a time: a free block at the
+ * top is grown into the new block, and whatever
+ * is left of the chunk becomes a free block after
+ * it. If something else moved the break since we
+ * last grew it, a new stretch of blocks is
+ * started where the break is now. Other arenas
+ * carve the block from their newest region,
+ * mapping another one if it is full.
+ *
+ * @param arena the arena to grow
+ * @param size the requested data_size
+ * @param dirty if not NULL, set to how many bytes
+ * at the start of the new block's data may not be
+ * zero
+ */
+Block *add_to_list(Arena *arena, size_t size, size_t *dirty)
+{
+  if (uses_sbrk(arena) && !huge_pages)
+  {
+    Block *start_fence = NULL;
+    Block *wilderness = NULL;
+    size_t prefix = 0;
+    size_t grow = sizeof(Block) + size;
+    void *start = sbrk(0);
+
+    if (heap_fence == NULL ||
+        PTR_ADD_BYTES(heap_fence, sizeof(Block)) != start)
+    {
+      // The break can start anywhere, so pad the
+      // first block until its data is aligned
+      start_fence = first_block_at(start);
+      prefix = (char *)start_fence - (char *)start + sizeof(Block);
+    }
+    else if ((heap_fence->size_and_flags & PREV_FREE) &&
+             get_data_size(prev_block(heap_fence)) < size)
+    {
+      // The free block at the top was too small,
+      // so grow it into the new block rather than
+      // leave it behind
+      wilderness = prev_block(heap_fence);
+      grow -= sizeof(Block) + get_data_size(wilderness);
+    }
+
+    // Grow by a whole chunk, and by top_pad bytes
+    // more than needed, as long as the rest is
+    // big enough for a free block of its own
+    size_t want = grow;
+    if (top_pad > 0)
+      want += sizeof(Block) + round_up_size(top_pad);
+    if (want < heap_chunk)
+      want = heap_chunk;
+    if (want - grow < sizeof(Block) + MINIMUM_ALLOCATION)
+      want = grow;
+
+    // Expand our heap, without the extra if even
+    // that is more than the OS will give
+    if (sbrk(prefix + want) != (void *)-1)
+    {
+      if (heap_chunk > 0 && heap_chunk < HEAP_CHUNK_MAX)
+        heap_chunk = heap_chunk < HEAP_CHUNK_MAX / 2 ? 2 * heap_chunk
+                                                     : HEAP_CHUNK_MAX;
+    }
+    else
+    {
+      want = grow;
+      if (sbrk(prefix + want) == (void *)-1)
+        return NULL;
+    }
+
+    if (start_fence != NULL)
+    {
+      if (heap_fence == NULL)
+      {
+        heap_start = start;
+        heap_first = start_fence;
+      }
+      set_fence(start_fence);
+      heap_fence = start_fence;
+    }
+
+    // Everything from the wilderness up to the
+    // break is ours now, just like from a fence
+    Block *block = heap_fence;
+    if (wilderness != NULL)
+    {
+      remove_from_bin(arena, wilderness);
+      count_block(arena, get_data_size(wilderness), -1);
+      block = wilderness;
+    }
+    extend_at_fence(arena, block, size);
+    heap_fence = next_block(block);
+    size_t used = claim_clean(&heap_clean, block);
+    if (dirty != NULL)
+      *dirty = used;
+
+    // The rest of the chunk becomes a free block
+    // of its own for the next requests to be
+    // carved from
+    if (want > grow)
+    {
+      Block *spare =
+          extend_at_fence(arena, heap_fence, want - grow - sizeof(Block));
+      heap_fence = next_block(spare);
+      claim_clean(&heap_clean, spare);
+      mark_free(spare, get_data_size(spare));
+      add_to_bin(arena, spare);
+    }
+    return block;
+  }
+
+  Region *region = arena->regions;
+  if (region == NULL || region_space(region) < sizeof(Block) + size)
+  {
+    region = add_region(arena, sizeof(Block) + size);
+    if (region == NULL)
+      return NULL;
+  }
+
+  Block *block = extend_at_fence(arena, region->top, size);
+  region->top = next_block(block);
+  size_t used = claim_clean(&region->clean, block);
+  if (dirty != NULL)
+    *dirty = used;
+  return block;
+}
+
+/**
+ * Give back the memory from a free block at the
+ * top of an arena onwards, turning the block into
+ * the new fence. The main arena calls brk(),
+ * other arenas just lower the top of their newest
+ * region so it can be carved again. When the
+ * main arena's only block goes, the break is put
+ * back exactly where we found it.
+ *
+ * The main arena only shrinks once the block has
+ * reached trim_threshold bytes, and keeps top_pad
+ * bytes of it as a smaller free block at the top.
+ *
+ * @param arena the arena to shrink
+ * @param block a coalesced FREE block, not in any
+ * bin
+ * @return 1 if the whole block was given back, 0
+ * if it is still a free block for the caller to
+ * put in its bin
+ */
+int contract_heap(Arena *arena, Block *block)
+{
+  Block *next = next_block(block);
+  size_t size = get_data_size(block);
+
+  if (uses_sbrk(arena))
+  {
+    // Only the top of the break can be given
+    // back, and only if it is still ours
+    if (next != heap_fence ||
+        PTR_ADD_BYTES(heap_fence, sizeof(Block)) != sbrk(0))
+      return 0;
+
+    // Below the threshold, the next malloc would
+    // most likely just ask for it back
+    if (size < trim_threshold)
+      return 0;
+
+    size_t keep = top_pad > 0 ? round_up_size(top_pad) : 0;
+    if (keep > 0)
+    {
+      // Not worth a brk() for less than a page
+      if (size < keep + sizeof(Block) + sysconf(_SC_PAGESIZE))
+        return 0;
+
+      Block *rest = PTR_ADD_BYTES(block, sizeof(Block) + keep);
+      count_block(arena, size, -1);
+      set_fence(rest);
+      mark_free(block, keep);
+      count_block(arena, keep, 1);
+      heap_fence = rest;
+      heap_chunk = heap_chunk_min;
+      brk(PTR_ADD_BYTES(rest, sizeof(Block)));
+      return 0;
+    }
+
+    if (block == heap_first)
+    {
+      brk(heap_start);
+      heap_start = NULL;
+      heap_first = NULL;
+      heap_fence = NULL;
+    }
+    else
+    {
+      set_fence(block);
+      heap_fence = block;
+      brk(PTR_ADD_BYTES(block, sizeof(Block)));
+    }
+    heap_chunk = heap_chunk_min;
+    count_block(arena, size, -1);
+    return 1;
+  }
+
+  if (next != arena->regions->top)
+    return 0;
+
+  set_fence(block);
+  arena->regions->top = block;
+  count_block(arena, size, -1);
+  return 1;
+}
+
+/**
+ * Print the attributes of a given Block data
+ * structure. A helper function for debugging
+ * purposes.
+ *
+ * @param block the block to print
+ */
+void print_block(Block *block)
+{
+  printf("THIS: %p, FREE?: %d, PREV_FREE?: %d, DATA_SIZE: %zu\n", block,
+         is_free(block), (block->size_and_flags & PREV_FREE) != 0,
+         get_data_size(block));
+}
+
+/**
+ * Print every block from a given block up to the
+ * next fence. Helper function for debugging
+ * purposes.
+ *
+ * @param block the first block to print
+ */
+void print_blocks_from(Block *block)
+{
+  for (; get_data_size(block) != 0; block = next_block(block))
+  {
+    print_block(block);
+  }
+}
+
+/**
+ * Print every block of an arena. Helper function
+ * for debugging purposes.
+ *
+ * @param arena the arena to print
+ */
+void print_blocks(Arena *arena)
+{
+  if (arena == &main_arena && heap_first != NULL)
+    print_blocks_from(heap_first);
+
+  for (Region *region = arena->regions; region != NULL; region = region->next)
+  {
+    print_blocks_from(region->first);
+  }
+}
+
+/**
+ * Take a lock, counting whether another thread
+ * was holding it.
+ *
+ * @param lock the lock to take
+ * @param stats the counters that go with it
+ */
+void lock_counted(pthread_mutex_t *lock, LockStats *stats)
+{
+  if (pthread_mutex_trylock(lock) != 0)
+  {
+    pthread_mutex_lock(lock);
+    stats->contended++;
+  }
+  stats->acquired++;
+}
+
+/**
+ * Take an arena's lock.
+ *
+ * @param arena the arena to lock
+ */
+void lock_arena(Arena *arena)
+{
+  lock_counted(&arena->lock, &arena->lock_stats);
+}
+
+/**
+ * Allocate a block from an arena. The caller
+ * must hold the arena's lock.
+ *
+ * @param arena the arena to allocate from
+ * @param size the data size to allocate, already
+ * rounded by round_up_size()
+ * @param dirty if not NULL, set to how many bytes
+ * at the start of the block's data may not be
+ * zero. Only blocks carved from memory that was
+ * never handed out before are known to be zero.
+ * @return the allocated block, or NULL if the
+ * arena could not be grown
+ */
+Block *arena_malloc(Arena *arena, size_t size, size_t *dirty)
+{
+  // Look through the bins for a free block that
+  // could fit our requested size
+  Block *free_block = find_free_block(arena, size);
+
+  // If we've found a free block, then we should
   // update the block to be TAKEN and to have the
   // correct size. If the requested size is less
   // than the free block's size, the block is
@@ -373,62 +2321,2756 @@ void *my_malloc(unsigned int size)
   // MINIMUM_ALLOCATION bytes.
   if (free_block != NULL)
   {
-    update_block(free_block, size);
+    update_block(arena, free_block, size);
+    if (dirty != NULL)
+      *dirty = get_data_size(free_block);
+  }
+  else
+  {
+    // If we could find no free block, then we
+    // attempt to add a block to the top of the
+    // arena by asking the OS for more memory.
+    free_block = add_to_list(arena, size, dirty);
+
+    // If we couldn't add a new block, something
+    // has gone quite wrong.
+    if (free_block == NULL)
+    {
+      printf("ERROR in my_malloc: could not allocate new block!\n");
+      return NULL;
+    }
+  }
+
+  return free_block;
+}
+
+/**
+ * Return a block to its arena. The caller must
+ * hold the arena's lock.
+ *
+ * @param arena the arena owning the block
+ * @param free_block the TAKEN block to free
+ */
+void arena_free(Arena *arena, Block *free_block)
+{
+  // Mark the block as free and attempt to
+  // coalesce. AKA, combine neighboring blocks
+  // that are all free so as to lessen the extent
+  // of external fragmentation.
+  uint64_t freed_at;
+  Block *after_coalesce = coalesce(arena, free_block, &freed_at);
+
+  // After coalescing, the remaining block might
+  // be at the top of the arena. If that is the
+  // case, we can signal to the OS that it can
+  // take back some of our memory. Otherwise it
+  // goes into its bin to be handed out again.
+  if (!contract_heap(arena, after_coalesce))
+  {
+    add_to_bin(arena, after_coalesce);
+    decay_inherit(arena, after_coalesce, freed_at, 0);
+  }
+
+  // Frees are when free memory builds up, so
+  // this is when older free blocks are purged
+  purge_decayed(arena);
+}
+
+/**
+ * Shrink a TAKEN block to a smaller data size.
+ * If enough is left over for a block of its own,
+ * it is split off and freed, otherwise the block
+ * keeps its size. The caller must hold the
+ * arena's lock.
+ *
+ * @param arena the arena owning the block
+ * @param block the TAKEN block to shrink
+ * @param size the new data size, already rounded
+ * by round_up_size()
+ */
+void shrink_block(Arena *arena, Block *block, size_t size)
+{
+  size_t size_left_over = get_data_size(block) - size;
+  if (size_left_over < sizeof(Block) + MINIMUM_ALLOCATION)
+    return;
+
+  count_block(arena, get_data_size(block), -1);
+  block->size_and_flags = size | (block->size_and_flags & PREV_FREE);
+  count_block(arena, size, 1);
+
+  // The tail starts out TAKEN so arena_free() can
+  // coalesce it with whatever follows
+  Block *tail = next_block(block);
+  tail->size_and_flags = size_left_over - sizeof(Block);
+  count_block(arena, get_data_size(tail), 1);
+  arena_free(arena, tail);
+}
+
+/**
+ * Move the fence at the top of an arena up by a
+ * number of bytes, getting more memory from the
+ * OS or the newest region as needed. The caller
+ * must hold the arena's lock.
+ *
+ * @param arena the arena to grow
+ * @param fence the fence to move
+ * @param bytes how far to move it
+ * @return 1 if the fence was moved, 0 if it is
+ * not at a top that can grow or the memory could
+ * not be had
+ */
+int grow_top(Arena *arena, Block *fence, size_t bytes)
+{
+  Block *new_fence = (Block *)PTR_ADD_BYTES(fence, bytes);
+
+  if (uses_sbrk(arena))
+  {
+    // Only grow the break if it is still ours
+    if (fence != heap_fence ||
+        PTR_ADD_BYTES(heap_fence, sizeof(Block)) != sbrk(0) ||
+        sbrk(bytes) == (void *)-1)
+      return 0;
+
+    heap_fence = new_fence;
+    if (heap_clean < (char *)(new_fence + 1))
+      heap_clean = (char *)(new_fence + 1);
+  }
+  else
+  {
+    Region *region = arena->regions;
+    if (fence != region->top || region_space(region) < bytes)
+      return 0;
+
+    region->top = new_fence;
+    if (region->clean < (char *)(new_fence + 1))
+      region->clean = (char *)(new_fence + 1);
+  }
+
+  set_fence(new_fence);
+  return 1;
+}
+
+/**
+ * Grow a TAKEN block to a bigger data size
+ * without moving it, by absorbing the free block
+ * after it and, at the top of the arena, by
+ * moving the fence. The caller must hold the
+ * arena's lock.
+ *
+ * @param arena the arena owning the block
+ * @param block the TAKEN block to grow
+ * @param size the new data size, already rounded
+ * by round_up_size()
+ * @return 1 if the block now holds size bytes, 0
+ * if it would have to move
+ */
+int grow_block(Arena *arena, Block *block, size_t size)
+{
+  size_t available = get_data_size(block);
+  Block *next = next_block(block);
+  Block *after = next;
+
+  if (is_free(next))
+  {
+    available += sizeof(Block) + get_data_size(next);
+    after = next_block(next);
+  }
+
+  if (available < size)
+  {
+    if (!grow_top(arena, after, size - available))
+      return 0;
+    available = size;
+  }
+
+  count_block(arena, get_data_size(block), -1);
+  if (is_free(next))
+  {
+    remove_from_bin(arena, next);
+    count_block(arena, get_data_size(next), -1);
+  }
+  mark_taken(block, available);
+  count_block(arena, available, 1);
+
+  // Absorbing the neighbor may have given us
+  // more than we need
+  shrink_block(arena, block, size);
+  return 1;
+}
+
+/**
+ * Turn a TAKEN block into one whose data is
+ * aligned to a given boundary. The space in front
+ * of the aligned data becomes a free block of its
+ * own, and whatever is left after size bytes is
+ * split off too. The caller must hold the
+ * arena's lock.
+ *
+ * @param arena the arena owning the block
+ * @param block a TAKEN block with at least
+ * alignment + sizeof(Block) + MINIMUM_ALLOCATION
+ * more bytes of data than size
+ * @param alignment a power of two above
+ * SIZE_MULTIPLE
+ * @param size the data size needed, already
+ * rounded by round_up_size()
+ * @return the aligned block
+ */
+Block *align_block(Arena *arena, Block *block, size_t alignment, size_t size)
+{
+  char *data = get_data_pointer(block);
+  char *aligned_data = (char *)ALIGN_UP(data, alignment);
+
+  if (aligned_data != data)
+  {
+    // The space in front must be big enough for a
+    // block of its own
+    if (aligned_data - data < sizeof(Block) + MINIMUM_ALLOCATION)
+      aligned_data += alignment;
+
+    Block *aligned = (Block *)(aligned_data - sizeof(Block));
+    size_t lead_size = (char *)aligned - data;
+
+    // Both start out TAKEN so arena_free() can
+    // coalesce the lead with whatever precedes it
+    count_block(arena, get_data_size(block), -1);
+    aligned->size_and_flags =
+        get_data_size(block) - lead_size - sizeof(Block);
+    block->size_and_flags = lead_size | (block->size_and_flags & PREV_FREE);
+    count_block(arena, lead_size, 1);
+    count_block(arena, get_data_size(aligned), 1);
+    arena_free(arena, block);
+    block = aligned;
+  }
+
+  shrink_block(arena, block, size);
+  return block;
+}
+
+/**
+ * Create a new arena backed by its own region.
+ * The Arena struct lives at the start of its
+ * first region, right after the Region struct.
+ *
+ * @param is_private whether the arena is only
+ * used through the my_arena_* functions
+ * @param node the NUMA node the arena's memory
+ * comes from, -1 for any
+ * @return the new arena, or NULL if the OS
+ * refused
+ */
+Arena *arena_create(int is_private, int node)
+{
+  Region *region = map_region(sizeof(Arena) + CACHE_LINE, node);
+  if (region == NULL)
+    return NULL;
+
+  // mmap() hands back zeroed memory, so the bins
+  // already start out empty
+  Arena *arena = (Arena *)ALIGN_UP(region + 1, CACHE_LINE);
+  pthread_mutex_init(&arena->lock, NULL);
+  for (unsigned int i = 0; i < NUM_TCACHE_BINS; i++)
+  {
+    pthread_mutex_init(&arena->central[i].lock, NULL);
+  }
+  arena->is_private = is_private;
+  arena->node = node;
+  arena->regions = region;
+  region->arena = arena;
+
+  region->first = first_block_at(arena + 1);
+  region->top = region->first;
+  region->clean = (char *)region->first;
+  set_fence(region->top);
+  return arena;
+}
+
+/**
+ * Get the number of shared arenas threads are
+ * spread over: arena_max if set, otherwise two
+ * per online CPU.
+ */
+unsigned int arena_limit()
+{
+  unsigned int limit = arena_max;
+  if (limit == 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    limit = cpus > 0 ? 2 * (unsigned int)cpus : 1;
+  }
+  return limit < MAX_ARENAS ? limit : MAX_ARENAS;
+}
+
+/**
+ * Get the NUMA node the calling thread is
+ * running on, or -1 if it is not known or too
+ * high for an arena of its own.
+ */
+int current_node()
+{
+  unsigned int cpu, node;
+
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 ||
+      node >= MAX_NUMA_NODES - 1)
+    return -1;
+  return node;
+}
+
+/**
+ * Get the number of NUMA nodes the machine can
+ * have, from sysfs. Read with plain system calls
+ * since stdio would allocate.
+ */
+unsigned int numa_node_count()
+{
+  static unsigned int count;
+  char text[64];
+
+  if (count != 0)
+    return count;
+
+  // A list such as "0" or "0-3"
+  ssize_t length = -1;
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+  if (fd >= 0)
+  {
+    length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+  }
+
+  unsigned int last = 0;
+  for (ssize_t i = 0; i < length; i++)
+  {
+    if (text[i] >= '0' && text[i] <= '9')
+      last = last * 10 + (text[i] - '0');
+    else
+      last = 0;
+    if (text[i] == '\n')
+      break;
+  }
+  count = last + 1 < MAX_NUMA_NODES ? last + 1 : MAX_NUMA_NODES;
+  return count;
+}
+
+/**
+ * Pick a shared arena of one NUMA node for a new
+ * thread: a new one while the node has fewer
+ * than its share of arena_limit(), otherwise the
+ * node's arenas round-robin. The caller must hold
+ * arenas_lock.
+ *
+ * @param node the node the thread runs on
+ * @return the arena, or NULL if the node has none
+ * and no new one could be made
+ */
+Arena *node_arena(int node)
+{
+  Arena *local[MAX_ARENAS];
+  unsigned int count = 0;
+  int empty = -1;
+
+  for (int i = 0; i < MAX_ARENAS; i++)
+  {
+    if (arenas[i] == NULL)
+    {
+      if (empty < 0)
+        empty = i;
+    }
+    else if (arenas[i]->node == node)
+    {
+      local[count++] = arenas[i];
+    }
+  }
+
+  unsigned int share = arena_limit() / numa_node_count();
+  if ((count == 0 || count < share) && empty >= 0)
+  {
+    arenas[empty] = arena_create(0, node);
+    if (arenas[empty] != NULL)
+      return arenas[empty];
+  }
+
+  if (count == 0)
+    return NULL;
+  return local[next_arena++ % count];
+}
+
+/**
+ * Check whether a slab has no object left to
+ * hand out.
+ *
+ * @param slab the slab to look at
+ */
+int slab_is_full(Slab *slab)
+{
+  return slab->free_list == NULL &&
+         slab->bump + slab->object_size > slab->end;
+}
+
+/**
+ * Add a slab to the front of a doubly linked
+ * list of slabs.
+ *
+ * @param list the head of the list
+ * @param slab the slab to add
+ */
+void slab_push(Slab **list, Slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+/**
+ * Take a slab out of a doubly linked list of
+ * slabs.
+ *
+ * @param list the head of the list
+ * @param slab the slab to remove
+ */
+void slab_unlink(Slab **list, Slab *slab)
+{
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+/**
+ * Map a new slab region for an arena. Its first
+ * page holds the Region struct, the rest are
+ * handed out as slabs.
+ *
+ * @param arena the arena the region is for
+ * @return the new region, or NULL if the OS
+ * refused
+ */
+Region *add_slab_region(Arena *arena)
+{
+  int huge = huge_pages;
+  Region *region = (Region *)map_aligned(REGION_SIZE, huge, arena->node);
+  if (region == NULL)
+    return NULL;
+
+  // mmap() hands back zeroed memory, so only the
+  // non-zero fields need setting
+  region->arena = arena;
+  region->size = REGION_SIZE;
+  region->huge = huge;
+  region->is_slab = 1;
+  region->next_slab = 1;
+
+  if (set_region_map(region, region) != 0)
+  {
+    munmap(region, REGION_SIZE);
+    return NULL;
+  }
+
+  region->next = arena->slab_regions;
+  arena->slab_regions = region;
+  return region;
+}
+
+/**
+ * Set up a slab for objects of one size and put
+ * it on its arena's partial list. Empty pages are
+ * reused first, then pages of the newest slab
+ * region that were never handed out. Only when
+ * both run out is a new region mapped.
+ *
+ * @param arena the arena to take the page from
+ * @param object_size the size of every object in
+ * the slab, a multiple of SIZE_MULTIPLE
+ * @return the new slab, or NULL if the OS refused
+ */
+Slab *slab_create(Arena *arena, size_t object_size)
+{
+  Slab *slab = arena->free_slabs;
+  Region *region;
+
+  if (slab != NULL)
+  {
+    slab_unlink(&arena->free_slabs, slab);
+    region = region_lookup(slab);
+  }
+  else
+  {
+    region = arena->slab_regions;
+    if (region == NULL || region->next_slab == SLABS_PER_REGION)
+    {
+      region = add_slab_region(arena);
+      if (region == NULL)
+        return NULL;
+    }
+    slab = (Slab *)PTR_ADD_BYTES(region, region->next_slab * SLAB_SIZE);
+    region->next_slab++;
+  }
+  region->slabs_in_use++;
+  arena->stats.slab_pages++;
+
+  slab->free_list = NULL;
+  slab->bump = (char *)ALIGN_UP(slab + 1, SIZE_MULTIPLE);
+  slab->end = (char *)slab + SLAB_SIZE;
+  slab->object_size = object_size;
+  slab->in_use = 0;
+  slab_push(&arena->partial_slabs[object_size / SIZE_MULTIPLE], slab);
+  return slab;
+}
+
+/**
+ * Give an empty slab page back. The page is kept
+ * for reuse unless it was the last page in use
+ * in a region other than the newest one, in
+ * which case the whole region is unmapped.
+ *
+ * @param arena the arena the slab belongs to
+ * @param slab an empty slab on no list
+ */
+void slab_release(Arena *arena, Slab *slab)
+{
+  Region *region = region_lookup(slab);
+
+  region->slabs_in_use--;
+  arena->stats.slab_pages--;
+  if (region->slabs_in_use > 0 || region == arena->slab_regions)
+  {
+    slab_push(&arena->free_slabs, slab);
+    return;
+  }
+
+  // Every other page of the region that was ever
+  // handed out is on the free list
+  for (unsigned int i = 1; i < region->next_slab; i++)
+  {
+    Slab *page = (Slab *)PTR_ADD_BYTES(region, i * SLAB_SIZE);
+    if (page != slab)
+      slab_unlink(&arena->free_slabs, page);
+  }
+
+  Region **link = &arena->slab_regions;
+  while (*link != region)
+  {
+    link = &(*link)->next;
+  }
+  *link = region->next;
+
+  set_region_map(region, NULL);
+  munmap(region, region->size);
+}
+
+/**
+ * Take an object from one of an arena's slabs,
+ * setting up a new slab if none of that size has
+ * room. The arena must be locked.
+ *
+ * @param arena the arena to allocate from
+ * @param size the object size, a multiple of
+ * SIZE_MULTIPLE of at most SLAB_MAX_SIZE
+ * @return the object, or NULL if the OS refused
+ */
+void *slab_malloc(Arena *arena, size_t size)
+{
+  Slab **list = &arena->partial_slabs[size / SIZE_MULTIPLE];
+  Slab *slab = *list;
+
+  if (slab == NULL)
+  {
+    slab = slab_create(arena, size);
+    if (slab == NULL)
+      return NULL;
+  }
+
+  // Reuse freed objects first, they are the most
+  // likely to be warm
+  void *object = slab->free_list;
+  if (object != NULL)
+  {
+    slab->free_list = *(void **)object;
+  }
+  else
+  {
+    object = slab->bump;
+    slab->bump += size;
+  }
+  slab->in_use++;
+
+  arena->stats.slab_objects++;
+  arena->stats.slab_object_bytes += size;
+  arena->stats.slab_objects_by_class[stats_class(size)]++;
+
+  if (slab_is_full(slab))
+    slab_unlink(list, slab);
+  return object;
+}
+
+/**
+ * Give an object back to its slab. A slab that
+ * was full goes back on the partial list, one
+ * that is now empty is released. The arena must
+ * be locked.
+ *
+ * @param arena the arena the object belongs to
+ * @param object an object from slab_malloc()
+ */
+void slab_free(Arena *arena, void *object)
+{
+  Slab *slab = (Slab *)((uintptr_t)object & ~(SLAB_SIZE - 1));
+  Slab **list = &arena->partial_slabs[slab->object_size / SIZE_MULTIPLE];
+  int was_full = slab_is_full(slab);
+
+  *(void **)object = slab->free_list;
+  slab->free_list = object;
+  slab->in_use--;
+
+  arena->stats.slab_objects--;
+  arena->stats.slab_object_bytes -= slab->object_size;
+  arena->stats.slab_objects_by_class[stats_class(slab->object_size)]--;
+
+  if (slab->in_use == 0)
+  {
+    if (!was_full)
+      slab_unlink(list, slab);
+    slab_release(arena, slab);
+  }
+  else if (was_full)
+  {
+    slab_push(list, slab);
+  }
+}
+
+/**
+ * Free everything other threads pushed on an
+ * arena's remote_frees. Taking the whole list at
+ * once means a pop never races a push for the
+ * same entry. The caller must hold the arena's
+ * lock.
+ *
+ * @param arena the arena to drain
+ */
+void remote_drain(Arena *arena)
+{
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  void *ptr = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&arena->remote_count, 0, __ATOMIC_RELAXED);
+  while (ptr != NULL)
+  {
+    void *next = *(void **)ptr;
+    Region *region = region_lookup(ptr);
+
+    if (region != NULL && region->is_slab)
+      slab_free(arena, ptr);
+    else
+      arena_free(arena, (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block)));
+    ptr = next;
+  }
+}
+
+/**
+ * Hand memory over to another thread's arena
+ * without taking its lock: one compare and swap
+ * pushes it on the arena's remote_frees.
+ *
+ * Nobody may take the lock for a long time,
+ * though, if the arena's threads are idle or
+ * gone. The list is freed right away when the
+ * arena has no threads left, and when it has
+ * grown to REMOTE_DRAIN_COUNT entries and the
+ * lock happens to be free.
+ *
+ * @param arena the arena owning the memory
+ * @param ptr a block's data or a slab object
+ */
+void remote_push(Arena *arena, void *ptr)
+{
+  void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+  do
+  {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, ptr, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  size_t count = __atomic_add_fetch(&arena->remote_count, 1, __ATOMIC_RELAXED);
+
+  // Pairs with arena_detach(): either the last
+  // thread's drain sees this entry, or this sees
+  // that the thread is gone
+  if (__atomic_load_n(&arena->threads, __ATOMIC_SEQ_CST) == 0)
+  {
+    lock_arena(arena);
+  }
+  else if (count < REMOTE_DRAIN_COUNT ||
+           pthread_mutex_trylock(&arena->lock) != 0)
+  {
+    return;
+  }
+  else
+  {
+    arena->lock_stats.acquired++;
+  }
+
+  remote_drain(arena);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Free a list of cached blocks and slab objects
+ * linked through their first word, each into its
+ * own arena. Consecutive entries from the same
+ * arena share one lock acquisition.
+ *
+ * @param ptr the data of the first entry
+ */
+void free_object_list(void *ptr)
+{
+  Arena *locked = NULL;
+
+  while (ptr != NULL)
+  {
+    void *next = *(void **)ptr;
+    Region *region = region_lookup(ptr);
+    Arena *arena = region != NULL ? region->arena : &main_arena;
+
+    if (arena != locked)
+    {
+      if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+      lock_arena(arena);
+      remote_drain(arena);
+      locked = arena;
+    }
+
+    if (region != NULL && region->is_slab)
+      slab_free(arena, ptr);
+    else
+      arena_free(arena, (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block)));
+    ptr = next;
+  }
+
+  if (locked != NULL)
+    pthread_mutex_unlock(&locked->lock);
+}
+
+/**
+ * Give everything cached back to its arena.
+ * Registered as the destructor of tcache_key so
+ * a thread's cache does not leak when the thread
+ * exits.
+ *
+ * @param arg unused
+ */
+void tcache_destroy(void *arg)
+{
+  (void)arg;
+
+  for (unsigned int i = 0; i < NUM_TCACHE_BINS; i++)
+  {
+    free_object_list(tcache.entries[i]);
+    tcache.entries[i] = NULL;
+    tcache.counts[i] = 0;
+  }
+}
+
+/**
+ * Create the key whose destructor flushes a
+ * thread's cache. Run once through pthread_once.
+ */
+void tcache_create_key() { pthread_key_create(&tcache_key, tcache_destroy); }
+
+/**
+ * Make sure the calling thread's cache will be
+ * flushed when the thread exits.
+ */
+void tcache_init()
+{
+  if (tcache.initialized)
+    return;
+
+  pthread_once(&tcache_key_once, tcache_create_key);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache.initialized = 1;
+}
+
+/**
+ * Hand a list of cached memory from one thread
+ * cache bin to the central bins of its arenas.
+ * Consecutive entries from the same arena share
+ * one lock acquisition. Entries that find their
+ * central bin full go straight back to their
+ * arena.
+ *
+ * @param index the thread cache bin the list came
+ * from
+ * @param ptr the first entry of the list
+ */
+void central_put(unsigned int index, void *ptr)
+{
+  CentralBin *locked = NULL;
+  void *overflow = NULL;
+
+  while (ptr != NULL)
+  {
+    void *next = *(void **)ptr;
+    CentralBin *bin = &arena_of(ptr)->central[index];
+
+    if (bin != locked)
+    {
+      if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+      lock_counted(&bin->lock, &bin->lock_stats);
+      locked = bin;
+    }
+
+    if (bin->count < CENTRAL_MAX_COUNT)
+    {
+      *(void **)ptr = bin->entries;
+      bin->entries = ptr;
+      bin->count++;
+    }
+    else
+    {
+      *(void **)ptr = overflow;
+      overflow = ptr;
+    }
+    ptr = next;
+  }
+
+  if (locked != NULL)
+    pthread_mutex_unlock(&locked->lock);
+
+  free_object_list(overflow);
+}
+
+/**
+ * Move up to max entries from an arena's central
+ * bin to the calling thread's cache.
+ *
+ * @param arena the arena to take entries from
+ * @param index the bin to fill
+ * @param max the most entries to move
+ * @return the number of entries moved
+ */
+unsigned int central_get(Arena *arena, unsigned int index, unsigned int max)
+{
+  CentralBin *bin = &arena->central[index];
+  unsigned int moved = 0;
+
+  lock_counted(&bin->lock, &bin->lock_stats);
+  while (moved < max && bin->entries != NULL)
+  {
+    void *ptr = bin->entries;
+    bin->entries = *(void **)ptr;
+    bin->count--;
+
+    *(void **)ptr = tcache.entries[index];
+    tcache.entries[index] = ptr;
+    tcache.counts[index]++;
+    moved++;
+  }
+  pthread_mutex_unlock(&bin->lock);
+
+  return moved;
+}
+
+/**
+ * Give everything in an arena's central bins back
+ * to the arena.
+ *
+ * @param arena the arena to drain
+ */
+void central_drain(Arena *arena)
+{
+  for (unsigned int i = 0; i < NUM_TCACHE_BINS; i++)
+  {
+    CentralBin *bin = &arena->central[i];
+
+    lock_counted(&bin->lock, &bin->lock_stats);
+    void *list = bin->entries;
+    bin->entries = NULL;
+    bin->count = 0;
+    pthread_mutex_unlock(&bin->lock);
+
+    free_object_list(list);
+  }
+}
+
+/**
+ * Let go of a thread's arena when the thread
+ * exits. Registered as the destructor of
+ * arena_key. Once an arena has no threads left,
+ * whoever frees memory into it frees it right
+ * away, so whatever is on remote_frees now is
+ * the last that would otherwise wait for a
+ * thread of the arena.
+ *
+ * @param arg the thread's arena
+ */
+void arena_detach(void *arg)
+{
+  Arena *arena = arg;
+
+  __atomic_sub_fetch(&arena->threads, 1, __ATOMIC_SEQ_CST);
+  lock_arena(arena);
+  remote_drain(arena);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Create the key whose destructor detaches a
+ * thread from its arena. Run once through
+ * pthread_once.
+ */
+void arena_create_key() { pthread_key_create(&arena_key, arena_detach); }
+
+/**
+ * Get the arena the calling thread allocates
+ * from. On a thread's first call it is assigned
+ * the next shared arena round-robin, so the first
+ * thread to allocate gets the main arena. With
+ * NUMA arenas on, only the arenas of the node the
+ * thread runs on take part. The arena counts the
+ * thread among its threads until it exits.
+ */
+Arena *get_thread_arena()
+{
+  if (thread_arena != NULL)
+    return thread_arena;
+
+  pthread_mutex_lock(&arenas_lock);
+  int node = numa_arenas ? current_node() : -1;
+  if (node >= 0)
+  {
+    thread_arena = node_arena(node);
+  }
+  else
+  {
+    unsigned int index = next_arena++ % arena_limit();
+    if (arenas[index] == NULL)
+    {
+      arenas[index] = arena_create(0, -1);
+    }
+    thread_arena = arenas[index];
+  }
+
+  // Fall back to the main arena if no new one
+  // could be mapped
+  if (thread_arena == NULL)
+    thread_arena = &main_arena;
+  pthread_mutex_unlock(&arenas_lock);
+
+  __atomic_add_fetch(&thread_arena->threads, 1, __ATOMIC_SEQ_CST);
+  pthread_once(&arena_key_once, arena_create_key);
+  pthread_setspecific(arena_key, thread_arena);
+
+  return thread_arena;
+}
+
+/**
+ * Check whether memory of an arena may be kept in
+ * the calling thread's cache: with NUMA arenas
+ * on, only memory of the thread's own node is, so
+ * that memory freed across nodes goes back to the
+ * node it came from.
+ *
+ * @param arena the arena the memory belongs to
+ */
+int is_local_arena(Arena *arena)
+{
+  return arena->node < 0 || arena->node == get_thread_arena()->node;
+}
+
+/**
+ * Fill an empty thread cache bin with a batch of
+ * memory. The central bin of the thread's arena
+ * is tried first; only if it is empty is the
+ * arena itself locked, once for the whole batch.
+ * The batch comes from slabs if the bin's size is
+ * served by them, from blocks otherwise.
+ *
+ * @param index the bin to fill
+ */
+void tcache_refill(unsigned int index)
+{
+  Arena *arena = get_thread_arena();
+  size_t size = index * SIZE_MULTIPLE;
+  int use_slabs = size <= slab_max;
+  unsigned int batch =
+      TCACHE_BATCH < tcache_count ? TCACHE_BATCH : tcache_count;
+
+  if (central_get(arena, index, batch) > 0)
+    return;
+
+  if (!use_slabs)
+    size = round_up_size(size);
+
+  lock_arena(arena);
+  remote_drain(arena);
+  for (unsigned int i = 0; i < batch; i++)
+  {
+    void *ptr;
+    if (use_slabs)
+    {
+      ptr = slab_malloc(arena, size);
+    }
+    else
+    {
+      Block *block = arena_malloc(arena, size, NULL);
+      ptr = block != NULL ? get_data_pointer(block) : NULL;
+    }
+    if (ptr == NULL)
+      break;
+
+    *(void **)ptr = tcache.entries[index];
+    tcache.entries[index] = ptr;
+    tcache.counts[index]++;
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Pass the oldest half of a full thread cache
+ * bin on to the central bins of the arenas its
+ * entries came from. The most recently freed
+ * entries stay cached since they are the most
+ * likely to be warm.
+ *
+ * @param index the bin to flush
+ */
+void tcache_flush(unsigned int index)
+{
+  unsigned int keep = tcache.counts[index] / 2;
+
+  // Skip over the entries we keep
+  void **link = &tcache.entries[index];
+  for (unsigned int i = 0; i < keep; i++)
+  {
+    link = (void **)*link;
+  }
+
+  central_put(index, *link);
+  *link = NULL;
+  tcache.counts[index] = keep;
+}
+
+/**
+ * Allocate a slab object from an arena, taking
+ * its lock.
+ *
+ * @param arena the arena to allocate from
+ * @param size the object size
+ * @return the object, or NULL if the OS refused
+ */
+void *locked_slab_malloc(Arena *arena, size_t size)
+{
+  lock_arena(arena);
+  remote_drain(arena);
+  void *ptr = slab_malloc(arena, size);
+  pthread_mutex_unlock(&arena->lock);
+  return ptr;
+}
+
+/**
+ * Allocate a block from an arena, taking its
+ * lock.
+ *
+ * @param arena the arena to allocate from
+ * @param size the rounded data size
+ * @return the block's data, or NULL if the arena
+ * could not be grown
+ */
+void *locked_arena_malloc(Arena *arena, size_t size)
+{
+  lock_arena(arena);
+  remote_drain(arena);
+  Block *block = arena_malloc(arena, size, NULL);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (block == NULL)
+    return NULL;
+  return get_data_pointer(block);
+}
+
+/**
+ * Give a large allocation a mapping of its own.
+ * The block header sits just before the first
+ * aligned address at least one word into the
+ * mapping, and its data size covers the rest of
+ * the pages, so my_free() can munmap() it without
+ * touching any arena. The word before the header
+ * holds the distance from the start of the
+ * mapping to the header.
+ *
+ * @param size the rounded data size
+ * @param alignment the alignment of the data, a
+ * power of two of at least SIZE_MULTIPLE
+ * @return the block's data, or NULL if the OS
+ * refused
+ */
+void *map_block(size_t size, size_t alignment)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_size = ALIGN_UP(2 * sizeof(Block) + size +
+                                 (alignment - SIZE_MULTIPLE),
+                             page_size);
+
+  char *memory = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+
+  char *data = (char *)ALIGN_UP(memory + 2 * sizeof(Block), alignment);
+  Block *block = (Block *)(data - sizeof(Block));
+  *(size_t *)PTR_ADD_BYTES(block, -sizeof(size_t)) = (char *)block - memory;
+  block->size_and_flags = (memory + map_size - data) | MAPPED;
+
+  __atomic_fetch_add(&mapped_blocks, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_data, get_data_size(block), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_by_class[stats_class(get_data_size(block))], 1,
+                     __ATOMIC_RELAXED);
+  return data;
+}
+
+/**
+ * Release the mapping of a MAPPED block.
+ *
+ * @param block a block from map_block()
+ */
+void unmap_block(Block *block)
+{
+  size_t offset = *(size_t *)PTR_ADD_BYTES(block, -sizeof(size_t));
+  size_t map_size = offset + sizeof(Block) + get_data_size(block);
+
+  __atomic_fetch_sub(&mapped_blocks, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&mapped_data, get_data_size(block), __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&mapped_by_class[stats_class(get_data_size(block))], 1,
+                     __ATOMIC_RELAXED);
+  munmap(PTR_ADD_BYTES(block, -offset), map_size);
+}
+
+/**
+ * Resize the mapping of a MAPPED block. mremap()
+ * moves the pages rather than copying them when
+ * the mapping cannot grow where it is.
+ *
+ * @param block a block from map_block()
+ * @param size the new rounded data size
+ * @return the block's data, which may have moved,
+ * or NULL if the OS refused
+ */
+void *remap_block(Block *block, size_t size)
+{
+  size_t offset = *(size_t *)PTR_ADD_BYTES(block, -sizeof(size_t));
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t old_map_size = offset + sizeof(Block) + get_data_size(block);
+  size_t map_size = ALIGN_UP(offset + sizeof(Block) + size, page_size);
+  unsigned int old_class = stats_class(get_data_size(block));
+
+  char *memory = mremap(PTR_ADD_BYTES(block, -offset), old_map_size,
+                        map_size, MREMAP_MAYMOVE);
+  if (memory == MAP_FAILED)
+    return NULL;
+
+  __atomic_fetch_sub(&mapped_by_class[old_class], 1, __ATOMIC_RELAXED);
+
+  // Only the size changes, so the difference
+  // goes into both totals
+  block = (Block *)(memory + offset);
+  block->size_and_flags = (map_size - offset - sizeof(Block)) | MAPPED;
+  __atomic_fetch_add(&mapped_bytes, map_size - old_map_size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_data, map_size - old_map_size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_by_class[stats_class(get_data_size(block))], 1,
+                     __ATOMIC_RELAXED);
+  return get_data_pointer(block);
+}
+
+/**
+ * Check whether the current call has to be
+ * traced: tracing is on and this is not a call
+ * the allocator makes to itself while serving an
+ * outer one that is traced already.
+ */
+int tracing()
+{
+  return !trace_nested && __atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+/**
+ * Write a buffer out in full, retrying short and
+ * interrupted writes.
+ *
+ * @param fd the file to write to
+ * @param data what to write
+ * @param size how many bytes to write
+ * @return 0 on success, -1 if the write failed
+ */
+int write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/**
+ * Write out the records buffered so far. The
+ * caller holds trace_lock.
+ */
+void trace_flush()
+{
+  write_all(trace_fd, (char *)trace_buffer,
+            trace_count * sizeof(my_trace_record_t));
+  trace_count = 0;
+}
+
+/**
+ * Append a record to the trace, if tracing is
+ * still on.
+ *
+ * @param op one of the MY_TRACE_* ops
+ * @param ptr the pointer the call took or
+ * returned
+ * @param size the size the call asked for
+ * @param alignment the alignment asked for, 0 if
+ * none
+ */
+void trace_record(uint8_t op, void *ptr, size_t size, size_t alignment)
+{
+  struct timespec now;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd < 0)
+  {
+    pthread_mutex_unlock(&trace_lock);
+    return;
+  }
+
+  if (trace_thread == 0)
+    trace_thread = ++trace_threads;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  my_trace_record_t *record = &trace_buffer[trace_count++];
+  record->timestamp =
+      (now.tv_sec * 1000000000ULL + now.tv_nsec) - trace_start_ns;
+  record->ptr = (uintptr_t)ptr;
+  record->size = size;
+  record->thread = trace_thread;
+  record->op = op;
+  record->alignment_shift = alignment != 0 ? __builtin_ctzll(alignment) : 0;
+  record->reserved = 0;
+
+  if (trace_count == TRACE_BUFFER_RECORDS)
+    trace_flush();
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Draw how many bytes the calling thread
+ * allocates before its next sample, from an
+ * exponential distribution with a mean of
+ * profile_rate. The random numbers come from a
+ * per thread xorshift generator and the
+ * logarithm from a polynomial, so no lock and
+ * no libm is needed.
+ *
+ * @return the new countdown, at least 1
+ */
+long profile_interval()
+{
+  if (profile_random == 0)
+    profile_random =
+        ((uintptr_t)&profile_random ^ (uint64_t)time(NULL) << 32) | 1;
+
+  profile_random ^= profile_random >> 12;
+  profile_random ^= profile_random << 25;
+  profile_random ^= profile_random >> 27;
+  uint64_t bits = (profile_random * 0x2545F4914F6CDD1DULL >> 11) + 1;
+
+  // u = bits / 2^53 is uniform in (0, 1], and
+  // the interval is -ln(u) * profile_rate. log2
+  // of the mantissa m in [1, 2) is approximated
+  // to within 0.01.
+  int exponent = 63 - __builtin_clzll(bits);
+  double m = (double)bits / ((uint64_t)1 << exponent);
+  double log2_u =
+      exponent - 53 + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+  double interval = -log2_u * 0.69314718 * profile_rate;
+
+  if (interval < 1)
+    return 1;
+  if (interval > LONG_MAX / 2)
+    return LONG_MAX / 2;
+  return interval;
+}
+
+/**
+ * Called when the calling thread's countdown runs
+ * out, to decide whether the allocation at hand
+ * is sampled. While it is, the countdown is
+ * parked at LONG_MAX so the calls made to serve
+ * it are not sampled too.
+ *
+ * @return 1 if the allocation is to be sampled,
+ * 0 if profiling is off
+ */
+int profile_begin()
+{
+  if (__atomic_load_n(&profile_rate, __ATOMIC_RELAXED) == 0)
+  {
+    profile_countdown = PROFILE_IDLE_BYTES;
+    return 0;
+  }
+
+  profile_countdown = LONG_MAX;
+  return 1;
+}
+
+/**
+ * Find the profile_table bucket of an address.
+ */
+unsigned int profile_bucket(void *ptr)
+{
+  return ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 48;
+}
+
+/**
+ * Check, without taking profile_lock, whether an
+ * address might belong to a live sample.
+ *
+ * @param ptr memory from the malloc family
+ * @return 0 if ptr is certainly not sampled
+ */
+int profile_maybe_sampled(void *ptr)
+{
+  return __atomic_load_n(&profile_table[profile_bucket(ptr)],
+                         __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ * Put a sample in profile_table under a given
+ * address. The caller holds profile_lock.
+ *
+ * @param sample the sample, on no list
+ * @param ptr the address of the sampled memory
+ * @param size the size that was asked for
+ */
+void profile_insert(Sample *sample, void *ptr, size_t size)
+{
+  Sample **bucket = &profile_table[profile_bucket(ptr)];
+
+  sample->ptr = ptr;
+  sample->size = size;
+  sample->next = *bucket;
+  __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the sample of an address out of
+ * profile_table. The caller holds profile_lock.
+ *
+ * @param ptr the address of the sampled memory
+ * @return the sample, or NULL if ptr has none
+ */
+Sample *profile_remove(void *ptr)
+{
+  Sample **link = &profile_table[profile_bucket(ptr)];
+
+  while (*link != NULL && (*link)->ptr != ptr)
+  {
+    link = &(*link)->next;
+  }
+
+  Sample *sample = *link;
+  if (sample != NULL)
+    __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+  return sample;
+}
+
+/**
+ * Get an unused sample. Samples are carved from
+ * mappings of their own, never from the heap
+ * they describe, and are reused but never given
+ * back. The caller holds profile_lock.
+ *
+ * @return the sample, or NULL if the OS refused
+ */
+Sample *profile_new_sample()
+{
+  if (profile_free_samples == NULL)
+  {
+    Sample *pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+      return NULL;
+
+    for (size_t i = 0; i < PROFILE_POOL_SIZE / sizeof(Sample); i++)
+    {
+      pool[i].next = profile_free_samples;
+      profile_free_samples = &pool[i];
+    }
+  }
+
+  Sample *sample = profile_free_samples;
+  profile_free_samples = sample->next;
+  return sample;
+}
+
+/**
+ * Record the stack of a sampled allocation and
+ * restart the calling thread's countdown. The
+ * first backtrace() of a process may allocate,
+ * which the parked countdown keeps from being
+ * sampled in turn.
+ *
+ * @param ptr the memory allocated, or NULL if the
+ * allocation failed
+ * @param size the size that was asked for
+ */
+void profile_end(void *ptr, size_t size)
+{
+  void *stack[PROFILE_MAX_DEPTH + 1];
+
+  // The first frame is this function
+  int depth = ptr != NULL ? backtrace(stack, PROFILE_MAX_DEPTH + 1) : 0;
+  if (depth > 1)
+  {
+    pthread_mutex_lock(&profile_lock);
+    Sample *sample = profile_new_sample();
+    if (sample != NULL)
+    {
+      sample->depth = depth - 1;
+      memcpy(sample->stack, stack + 1, (depth - 1) * sizeof(void *));
+      profile_insert(sample, ptr, size);
+    }
+    pthread_mutex_unlock(&profile_lock);
+  }
+
+  profile_countdown = profile_interval();
+}
+
+/**
+ * Drop the sample of memory that is being freed,
+ * if it has one.
+ *
+ * @param ptr the memory being freed
+ */
+void profile_forget(void *ptr)
+{
+  pthread_mutex_lock(&profile_lock);
+  Sample *sample = profile_remove(ptr);
+  if (sample != NULL)
+  {
+    sample->next = profile_free_samples;
+    profile_free_samples = sample;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Allocate memory of a given size.
+ *
+ * Small requests are served from the calling
+ * thread's cache without taking any lock. Only
+ * when that runs dry, or for larger sizes, is
+ * the thread's arena locked. Requests of up to
+ * slab_max bytes are carved from slabs, larger
+ * ones from blocks. Requests of at least
+ * mmap_threshold bytes bypass the arenas and get
+ * a mapping of their own.
+ *
+ * @param size the number of bytes to allocate
+ * @return a void pointer pointing to the newly
+ * allocated memory
+ */
+void *my_malloc(size_t size)
+{
+  if (tracing())
+  {
+    trace_nested = 1;
+    void *ptr = my_malloc(size);
+    trace_nested = 0;
+
+    if (ptr != NULL)
+      trace_record(MY_TRACE_MALLOC, ptr, size, 0);
+    return ptr;
+  }
+
+  if ((profile_countdown -= size) < 0 && profile_begin())
+  {
+    void *ptr = my_malloc(size);
+    profile_end(ptr, size);
+    return ptr;
+  }
+
+  if (size == 0)
+    return NULL;
+
+  // Refuse sizes that would wrap around once the
+  // header and rounding are added
+  if (size > SIZE_MAX / 2)
+    return NULL;
+
+  if (size <= TCACHE_MAX_SIZE && tcache_count > 0)
+  {
+    // Every entry of a bin has room for at least
+    // index * SIZE_MULTIPLE bytes, whether it is
+    // a slab object or a block
+    unsigned int index = ALIGN_UP(size, SIZE_MULTIPLE) / SIZE_MULTIPLE;
+
+    tcache_init();
+    if (tcache.entries[index] == NULL)
+    {
+      tcache_refill(index);
+      if (tcache.entries[index] == NULL)
+        return NULL;
+    }
+
+    void *ptr = tcache.entries[index];
+    tcache.entries[index] = *(void **)ptr;
+    tcache.counts[index]--;
+    return ptr;
+  }
+
+  if (size <= slab_max)
+    return locked_slab_malloc(get_thread_arena(),
+                              ALIGN_UP(size, SIZE_MULTIPLE));
+
+  // Ensure our size is correctly aligned.
+  // In other words, a request for 17 bytes is
+  // rounded up to 24. A request for 25 bytes is
+  // rounded up to 40. 50 is rounded to 56. etc.
+  // Anything below 24 bytes is rounded to 24
+  size = round_up_size(size);
+
+  if (size >= mmap_threshold)
+    return map_block(size, SIZE_MULTIPLE);
+
+  // Finally, return the address of our
+  // updated/newly allocated block's data
+  // segment.
+  return locked_arena_malloc(get_thread_arena(), size);
+}
+
+/**
+ * Keep freed memory in the calling thread's
+ * cache, flushing the bin first if it is full.
+ *
+ * @param index the bin: ptr has room for at
+ * least index * SIZE_MULTIPLE bytes
+ * @param ptr a slab object or TAKEN block of a
+ * shared arena local to this thread
+ */
+void tcache_put(unsigned int index, void *ptr)
+{
+  tcache_init();
+  if (tcache.counts[index] >= tcache_count)
+  {
+    tcache_flush(index);
+  }
+
+  *(void **)ptr = tcache.entries[index];
+  tcache.entries[index] = ptr;
+  tcache.counts[index]++;
+}
+
+/**
+ * Relinquish allocated memory to be reallocated later.
+ *
+ * Small blocks and slab objects are kept in the
+ * calling thread's cache, blocks still marked
+ * TAKEN, so they can be handed out again without
+ * a lock. Everything else goes back to the arena
+ * it came from: straight away for the thread's
+ * own arena and private arenas, through the
+ * arena's remote_frees for any other. Blocks
+ * with their own mapping are unmapped.
+ *
+ * @param ptr A pointer to the section of memory
+ * to free
+ */
+void my_free(void *ptr)
+{
+  if (ptr == NULL)
+    return;
+
+  // Recorded first: once the memory is released,
+  // another thread may get the same address
+  if (tracing())
+    trace_record(MY_TRACE_FREE, ptr, 0, 0);
+
+  // Likewise, the sample has to go before the
+  // address can be sampled again
+  if (profile_maybe_sampled(ptr))
+    profile_forget(ptr);
+
+  // Slab objects have no header, so they have to
+  // be recognized by their region first
+  Region *region = region_lookup(ptr);
+  int is_slab = region != NULL && region->is_slab;
+
+  // Get the location of the given memory's Block
+  // structure.
+  Block *free_block = (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block));
+
+  if (!is_slab && is_mapped(free_block))
+  {
+    unmap_block(free_block);
+    return;
+  }
+
+  Arena *arena = region != NULL ? region->arena : &main_arena;
+  size_t size =
+      is_slab ? slab_of(ptr)->object_size : get_data_size(free_block);
+
+  if (size <= TCACHE_MAX_SIZE && tcache_count > 0 && !arena->is_private &&
+      is_local_arena(arena))
+  {
+    tcache_put(size / SIZE_MULTIPLE, ptr);
+    return;
+  }
+
+  // Memory of another thread's arena is left for
+  // that thread to free, rather than fighting it
+  // for its lock
+  if (thread_arena != NULL && arena != thread_arena && !arena->is_private)
+  {
+    remote_push(arena, ptr);
+    return;
+  }
+
+  lock_arena(arena);
+  remote_drain(arena);
+  if (is_slab)
+    slab_free(arena, ptr);
+  else
+    arena_free(arena, free_block);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Free memory whose size the caller knows, as
+ * C++ sized delete and free_sized() do.
+ *
+ * The size picks the thread cache bin directly:
+ * a slab object of a shared arena is cached
+ * without reading its slab's header, which sits
+ * on another page. Blocks are freed like
+ * my_free() would, since a block may have been
+ * made with more room than its size asks for
+ * and only its header says which bin it fits.
+ *
+ * With MY_M_CHECK_FREE_SIZE on, a size larger
+ * than the memory's usable size is reported and
+ * the program aborted.
+ *
+ * @param ptr memory from any of the allocation
+ * functions, or NULL
+ * @param size the size it was allocated, or last
+ * reallocated, with
+ */
+void my_free_sized(void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+
+  if (check_free_size && size > my_malloc_usable_size(ptr))
+  {
+    printf("ERROR in my_free_sized: %zu bytes freed at %p, which has %zu!\n",
+           size, ptr, my_malloc_usable_size(ptr));
+    abort();
+  }
+
+  // Traced and sampled memory takes the long way,
+  // and so does a size of 0, which would pick the
+  // bin malloc never takes from
+  if (size == 0 || size > TCACHE_MAX_SIZE || tcache_count == 0 ||
+      tracing() || profile_maybe_sampled(ptr))
+  {
+    my_free(ptr);
+    return;
+  }
+
+  Region *region = region_lookup(ptr);
+  if (region == NULL || !region->is_slab || region->arena->is_private ||
+      !is_local_arena(region->arena))
+  {
+    my_free(ptr);
+    return;
+  }
+
+  // Slab objects are the size asked for rounded
+  // up to SIZE_MULTIPLE, or larger if realloc()
+  // left a shrinking one where it was, so this
+  // bin never promises more room than they have
+  tcache_put(ALIGN_UP(size, SIZE_MULTIPLE) / SIZE_MULTIPLE, ptr);
+}
+
+/**
+ * Allocate zeroed memory for an array.
+ *
+ * Memory the OS just gave us is already zero, so
+ * fresh mappings are not cleared at all and
+ * blocks carved from the top of an arena only
+ * have the part that was used before cleared.
+ *
+ * @param count the number of elements
+ * @param size the size of each element
+ * @return a pointer to the zeroed memory, or NULL
+ * if count * size overflows or is 0
+ */
+void *my_calloc(size_t count, size_t size)
+{
+  if (tracing())
+  {
+    trace_nested = 1;
+    void *ptr = my_calloc(count, size);
+    trace_nested = 0;
+
+    if (ptr != NULL)
+      trace_record(MY_TRACE_CALLOC, ptr, count * size, 0);
+    return ptr;
+  }
+
+  if (size != 0 && count > SIZE_MAX / size)
+    return NULL;
+
+  size_t total = count * size;
+  if (total == 0 || total > SIZE_MAX / 2)
+    return NULL;
+
+  // Cached memory and slab objects could hold
+  // anything, and are too small for the memset to
+  // matter
+  if (total <= slab_max || (total <= TCACHE_MAX_SIZE && tcache_count > 0))
+  {
+    void *ptr = my_malloc(total);
+    if (ptr != NULL)
+      memset(ptr, 0, total);
+    return ptr;
+  }
+
+  if ((profile_countdown -= total) < 0 && profile_begin())
+  {
+    void *ptr = my_calloc(count, size);
+    profile_end(ptr, total);
+    return ptr;
+  }
+
+  size_t data_size = round_up_size(total);
+
+  if (data_size >= mmap_threshold)
+    return map_block(data_size, SIZE_MULTIPLE);
+
+  Arena *arena = get_thread_arena();
+  size_t dirty;
+
+  lock_arena(arena);
+  remote_drain(arena);
+  Block *block = arena_malloc(arena, data_size, &dirty);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (block == NULL)
+    return NULL;
+
+  memset(get_data_pointer(block), 0, dirty < total ? dirty : total);
+  return get_data_pointer(block);
+}
+
+/**
+ * Change the size of an allocation, keeping its
+ * contents.
+ *
+ * Shrinking always happens in place. Growing
+ * first tries to absorb a free block right after
+ * this one or to move the fence when the block is
+ * at the top of its arena, and only falls back to
+ * allocating, copying and freeing when neither
+ * works. Blocks with their own mapping are
+ * resized with mremap(). Slab objects stay put as
+ * long as the new size fits their object size.
+ *
+ * @param ptr the memory to resize, or NULL to
+ * allocate new memory
+ * @param size the new size in bytes. 0 frees ptr.
+ * @return a pointer to the resized memory, or
+ * NULL if it could not be resized, in which case
+ * ptr is left alone
+ */
+void *my_realloc(void *ptr, size_t size)
+{
+  if (tracing())
+  {
+    // The old pointer may be freed and handed out
+    // to another thread before this call returns,
+    // so it is recorded up front
+    trace_record(MY_TRACE_REALLOC, ptr, size, 0);
+    trace_nested = 1;
+    void *new_ptr = my_realloc(ptr, size);
+    trace_nested = 0;
+    trace_record(MY_TRACE_REALLOC_RESULT, new_ptr, size, 0);
+    return new_ptr;
+  }
+
+  if (ptr == NULL)
+    return my_malloc(size);
+
+  if (size == 0)
+  {
+    my_free(ptr);
+    return NULL;
+  }
+
+  if (size > SIZE_MAX / 2)
+    return NULL;
+
+  // A sampled allocation keeps its sample, with
+  // the size updated, wherever it ends up. The
+  // memory is not sampled again on the way.
+  if (profile_maybe_sampled(ptr))
+  {
+    pthread_mutex_lock(&profile_lock);
+    Sample *sample = profile_remove(ptr);
+    pthread_mutex_unlock(&profile_lock);
+
+    if (sample != NULL)
+    {
+      long countdown = profile_countdown;
+      profile_countdown = LONG_MAX;
+      void *new_ptr = my_realloc(ptr, size);
+      profile_countdown = countdown;
+
+      pthread_mutex_lock(&profile_lock);
+      if (new_ptr != NULL)
+        profile_insert(sample, new_ptr, size);
+      else
+        profile_insert(sample, ptr, sample->size);
+      pthread_mutex_unlock(&profile_lock);
+      return new_ptr;
+    }
+  }
+
+  Slab *slab = slab_of(ptr);
+  if (slab != NULL)
+  {
+    if (size <= slab->object_size)
+      return ptr;
+
+    void *new_ptr = my_malloc(size);
+    if (new_ptr == NULL)
+      return NULL;
+
+    memcpy(new_ptr, ptr, slab->object_size);
+    my_free(ptr);
+    return new_ptr;
+  }
+
+  Block *block = (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block));
+  size_t old_size = get_data_size(block);
+  size_t new_size = round_up_size(size);
+
+  if (is_mapped(block))
+    return remap_block(block, new_size);
+
+  Arena *arena = arena_of(block);
+  int in_place = 1;
+
+  lock_arena(arena);
+  remote_drain(arena);
+  if (new_size <= old_size)
+    shrink_block(arena, block, new_size);
+  else
+    in_place = grow_block(arena, block, new_size);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (in_place)
+    return ptr;
+
+  // Memory from a private arena stays in it
+  void *new_ptr = arena->is_private ? my_arena_malloc(arena, size)
+                                    : my_malloc(size);
+  if (new_ptr == NULL)
+    return NULL;
+
+  memcpy(new_ptr, ptr, old_size);
+  my_free(ptr);
+  return new_ptr;
+}
+
+/**
+ * Allocate memory whose address is a multiple of
+ * a given alignment.
+ *
+ * A block with room to spare is allocated and
+ * the space in front of the first aligned address
+ * is split off as a free block, as is anything
+ * left at the end. Large requests get a mapping
+ * of their own with the data placed at an
+ * aligned address inside it.
+ *
+ * @param alignment a power of two
+ * @param size the number of bytes to allocate
+ * @return a pointer to the aligned memory, or
+ * NULL if alignment is not a power of two or the
+ * memory could not be had
+ */
+void *my_aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+
+  if (tracing())
+  {
+    trace_nested = 1;
+    void *ptr = my_aligned_alloc(alignment, size);
+    trace_nested = 0;
+
+    if (ptr != NULL)
+      trace_record(MY_TRACE_ALIGNED, ptr, size, alignment);
+    return ptr;
+  }
+
+  // Every block is aligned this much anyway
+  if (alignment <= SIZE_MULTIPLE)
+    return my_malloc(size);
+
+  if ((profile_countdown -= size) < 0 && profile_begin())
+  {
+    void *ptr = my_aligned_alloc(alignment, size);
+    profile_end(ptr, size);
+    return ptr;
+  }
+
+  if (size == 0 || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4)
+    return NULL;
+
+  size = round_up_size(size);
+
+  if (size >= mmap_threshold)
+    return map_block(size, alignment);
+
+  // Enough to reach an aligned address far enough
+  // in to leave room for a free block in front
+  size_t padded =
+      round_up_size(size + alignment + sizeof(Block) + MINIMUM_ALLOCATION);
+  Arena *arena = get_thread_arena();
+
+  lock_arena(arena);
+  remote_drain(arena);
+  Block *block = arena_malloc(arena, padded, NULL);
+  if (block != NULL)
+    block = align_block(arena, block, alignment, size);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (block == NULL)
+    return NULL;
+  return get_data_pointer(block);
+}
+
+/**
+ * Allocate aligned memory, POSIX style.
+ *
+ * @param memptr where to store the pointer to the
+ * allocated memory
+ * @param alignment a power of two multiple of
+ * sizeof(void *)
+ * @param size the number of bytes to allocate
+ * @return 0 on success, EINVAL if alignment is
+ * not valid, ENOMEM if the memory could not be
+ * had
+ */
+int my_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+      (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  void *ptr = my_aligned_alloc(alignment, size);
+  if (ptr == NULL && size != 0)
+    return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+/**
+ * Get how many bytes of an allocation can be
+ * used, which may be more than were asked for.
+ *
+ * @param ptr memory from any of the allocation
+ * functions, or NULL
+ * @return the usable size of ptr, 0 for NULL
+ */
+size_t my_malloc_usable_size(void *ptr)
+{
+  if (ptr == NULL)
+    return 0;
+
+  Slab *slab = slab_of(ptr);
+  if (slab != NULL)
+    return slab->object_size;
+
+  return get_data_size((Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block)));
+}
+
+/**
+ * Split runs of blocks off an arena for a batch:
+ * each run is taken as one block of the right
+ * size, found or made like any other, and then
+ * cut into count blocks in one pass by writing
+ * the headers in between. The caller must hold
+ * the arena's lock.
+ *
+ * @param arena the arena to allocate from
+ * @param size the rounded data size of every
+ * block
+ * @param count how many blocks to carve
+ * @param ptrs where to store their data pointers
+ * @return how many blocks were carved, fewer than
+ * count if the OS refused
+ */
+size_t carve_batch(Arena *arena, size_t size, size_t count, void **ptrs)
+{
+  size_t stride = sizeof(Block) + size;
+  size_t per_run = BATCH_RUN_BYTES / stride > 0 ? BATCH_RUN_BYTES / stride : 1;
+  size_t done = 0;
+
+  while (done < count)
+  {
+    size_t n = count - done < per_run ? count - done : per_run;
+    Block *run = arena_malloc(arena, n * stride - sizeof(Block), NULL);
+    if (run == NULL)
+      break;
+
+    // The run may have come out a little bigger,
+    // which goes to its last block
+    size_t run_size = get_data_size(run);
+    count_block(arena, run_size, -1);
+
+    Block *block = run;
+    for (size_t i = 0; i < n; i++)
+    {
+      size_t block_size = i + 1 < n ? size : run_size - (n - 1) * stride;
+      if (block == run)
+        block->size_and_flags = block_size | (run->size_and_flags & PREV_FREE);
+      else
+        block->size_and_flags = block_size;
+      count_block(arena, block_size, 1);
+
+      ptrs[done + i] = get_data_pointer(block);
+      block = next_block(block);
+    }
+    done += n;
+  }
+  return done;
+}
+
+/**
+ * Allocate many objects of the same size at once.
+ * The thread's arena is locked once for all of
+ * them: small ones come straight from its slabs,
+ * larger ones are carved side by side from a few
+ * big blocks. Each object is released with
+ * my_free() or my_free_batch() as usual.
+ *
+ * While the heap profiler is on, or for sizes
+ * that get a mapping of their own, this just
+ * calls my_malloc() count times.
+ *
+ * @param size the number of bytes of each object
+ * @param count the number of objects
+ * @param ptrs where to store the count pointers
+ * @return how many objects were allocated, from
+ * the start of ptrs, fewer than count if the OS
+ * refused
+ */
+size_t my_malloc_batch(size_t size, size_t count, void **ptrs)
+{
+  size_t done = 0;
+
+  if (size == 0 || size > SIZE_MAX / 2)
+    return 0;
+
+  if (__atomic_load_n(&profile_rate, __ATOMIC_RELAXED) > 0 ||
+      (size > slab_max && round_up_size(size) >= mmap_threshold))
+  {
+    while (done < count && (ptrs[done] = my_malloc(size)) != NULL)
+    {
+      done++;
+    }
+    return done;
+  }
+
+  Arena *arena = get_thread_arena();
+  lock_arena(arena);
+  remote_drain(arena);
+  if (size <= slab_max)
+  {
+    size_t object_size = ALIGN_UP(size, SIZE_MULTIPLE);
+    while (done < count &&
+           (ptrs[done] = slab_malloc(arena, object_size)) != NULL)
+    {
+      done++;
+    }
   }
   else
   {
-    // If we could find no free block, then we
-    // attempt to add a block to the end of our
-    // linked list by asking the OS for more heap
-    // space.
-    free_block = add_to_list(size);
-
-    // If we couldn't add a new block to the end
-    // of our linked list, something has gone
-    // quite wrong.
-    if (free_block == NULL)
+    done = carve_batch(arena, round_up_size(size), count, ptrs);
+  }
+  pthread_mutex_unlock(&arena->lock);
+
+  if (tracing())
+  {
+    for (size_t i = 0; i < done; i++)
     {
-      printf("ERROR in my_malloc: could not allocate new block!\n");
-      return NULL;
+      trace_record(MY_TRACE_MALLOC, ptrs[i], size, 0);
     }
   }
+  return done;
+}
 
-  // Finally, return the address of our
-  // updated/newly allocated block's data
-  // segment.
-  return get_data_pointer(free_block);
+/**
+ * Free many objects at once. An arena is locked
+ * once for every stretch of ptrs from it, and
+ * blocks listed in address order that sit next to
+ * each other, as those of my_malloc_batch() do,
+ * are merged into one block before going back to
+ * the arena, which then coalesces, bins or gives
+ * back the whole run in one go. Nothing goes into
+ * the thread cache.
+ *
+ * @param ptrs the objects to free, from any of
+ * the allocation functions, or NULL
+ * @param count how many there are
+ */
+void my_free_batch(void **ptrs, size_t count)
+{
+  // Recorded and forgotten first, as in my_free()
+  for (size_t i = 0; i < count; i++)
+  {
+    if (ptrs[i] != NULL && tracing())
+      trace_record(MY_TRACE_FREE, ptrs[i], 0, 0);
+    if (ptrs[i] != NULL && profile_maybe_sampled(ptrs[i]))
+      profile_forget(ptrs[i]);
+  }
+
+  Arena *locked = NULL;
+  size_t i = 0;
+  while (i < count)
+  {
+    void *ptr = ptrs[i++];
+    if (ptr == NULL)
+      continue;
+
+    Region *region = region_lookup(ptr);
+    int is_slab = region != NULL && region->is_slab;
+    Block *block = (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block));
+
+    if (!is_slab && is_mapped(block))
+    {
+      unmap_block(block);
+      continue;
+    }
+
+    Arena *arena = region != NULL ? region->arena : &main_arena;
+    if (arena != locked)
+    {
+      if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+      lock_arena(arena);
+      remote_drain(arena);
+      locked = arena;
+    }
+
+    if (is_slab)
+    {
+      slab_free(arena, ptr);
+      continue;
+    }
+
+    // Absorb the following blocks that are in the
+    // batch too, headers and all
+    while (i < count && ptrs[i] == get_data_pointer(next_block(block)))
+    {
+      size_t size = get_data_size(block);
+      size_t next_size = get_data_size(next_block(block));
+      size_t merged = size + sizeof(Block) + next_size;
+
+      count_block(arena, size, -1);
+      count_block(arena, next_size, -1);
+      count_block(arena, merged, 1);
+      block->size_and_flags = merged | (block->size_and_flags & PREV_FREE);
+      i++;
+    }
+    arena_free(arena, block);
+  }
+
+  if (locked != NULL)
+    pthread_mutex_unlock(&locked->lock);
 }
 
 /**
- * Relinquish allocated memory to be reallocated later.
- * 
- * @param ptr A pointer to the section of memory
- * to free
+ * Create a private arena. Memory allocated from
+ * it with my_arena_malloc() is released with
+ * my_free() as usual, or all at once by
+ * my_arena_destroy().
+ *
+ * @return the new arena, or NULL if the OS
+ * refused
  */
-void my_free(void *ptr)
+my_arena_t *my_arena_create() { return arena_create(1, -1); }
+
+/**
+ * Allocate memory of a given size from a private
+ * arena. The thread cache, slabs and the mmap
+ * path for large requests are bypassed so that
+ * nothing outlives the arena.
+ *
+ * @param arena an arena from my_arena_create()
+ * @param size the number of bytes to allocate
+ * @return a pointer to the allocated memory
+ */
+void *my_arena_malloc(my_arena_t *arena, size_t size)
 {
-  if (ptr == NULL)
+  if (size == 0 || size > SIZE_MAX / 2)
+    return NULL;
+
+  return locked_arena_malloc(arena, round_up_size(size));
+}
+
+/**
+ * Release a private arena and everything
+ * allocated from it by unmapping its regions.
+ * The cost depends on the number of regions, not
+ * on the number of allocations.
+ *
+ * @param arena an arena from my_arena_create()
+ */
+void my_arena_destroy(my_arena_t *arena)
+{
+  if (arena == NULL || !arena->is_private)
     return;
 
-  // Get the location of the given memory's Block
-  // structure.
-  Block *free_block = (Block *)PTR_ADD_BYTES(ptr, -1 * sizeof(Block));
+  pthread_mutex_destroy(&arena->lock);
+
+  // The arena itself sits in the oldest region,
+  // which is the last one we unmap
+  Region *region = arena->regions;
+  while (region != NULL)
+  {
+    Region *next = region->next;
+    set_region_map(region, NULL);
+    munmap(region, region->size);
+    region = next;
+  }
+}
+
+/**
+ * Adjust one of the allocator's tunables.
+ *
+ * MY_M_TCACHE_COUNT sets how many blocks each
+ * thread may cache per size, 0 turning the thread
+ * cache off. The calling thread's cache and the
+ * central bins of the shared arenas are flushed
+ * so that they never hold more than the new
+ * limit.
+ *
+ * MY_M_ARENA_MAX sets how many shared arenas
+ * threads are spread over, 0 meaning two per
+ * CPU. It only affects threads that have not
+ * allocated yet.
+ *
+ * MY_M_MMAP_THRESHOLD sets the request size from
+ * which memory is mapped separately instead of
+ * being taken from an arena.
+ *
+ * MY_M_SLAB_MAX sets the largest request served
+ * from slabs, at most SLAB_MAX_SIZE, 0 turning
+ * slabs off. Objects already handed out stay in
+ * their slabs until freed.
+ *
+ * MY_M_PURGE_DECAY sets how many milliseconds a
+ * free block of PURGE_MIN_SIZE bytes or more
+ * stays resident before the pages inside it are
+ * given back to the OS, -1 meaning never. The
+ * decay is checked whenever an arena frees a
+ * block.
+ *
+ * MY_M_PROFILE_RATE sets the average number of
+ * bytes allocated between two samples of the
+ * heap profiler, 0 turning it off. Samples taken
+ * so far are kept until their memory is freed.
+ *
+ * MY_M_TRIM_THRESHOLD sets how big the free
+ * block at the top of the sbrk heap must grow
+ * before the heap shrinks, and MY_M_TOP_PAD how
+ * many bytes of it the heap keeps when it does,
+ * and asks for on top of every request when it
+ * grows. Setting both to 0 gives every byte back
+ * as soon as it is freed.
+ *
+ * MY_M_HEAP_CHUNK sets the smallest step the sbrk
+ * heap grows by, doubling while it keeps growing
+ * up to HEAP_CHUNK_MAX, 0 growing it by no more
+ * than each request needs.
+ *
+ * MY_M_NUMA_ARENAS set to 1 gives threads that
+ * have not allocated yet arenas of the NUMA node
+ * they run on, whose memory prefers that node.
+ * Memory freed on another node then goes back to
+ * its arena instead of the thread cache.
+ *
+ * MY_M_CHECK_FREE_SIZE set to 1 makes
+ * my_free_sized() check every size it is given,
+ * aborting on one larger than the memory.
+ *
+ * MY_M_HUGE_PAGES set to 1 backs the regions
+ * mapped from then on with transparent huge
+ * pages, the main arena's included: it stops
+ * growing with sbrk() the next time it needs
+ * memory. 0 turns it back off for new regions.
+ *
+ * @param param which tunable to change
+ * @param value the new value
+ * @return 1 on success, 0 if param or value is
+ * invalid
+ */
+int my_mallopt(int param, int value)
+{
+  switch (param)
+  {
+  case MY_M_TCACHE_COUNT:
+    if (value < 0 || value > TCACHE_MAX_COUNT)
+      return 0;
+    if (tcache.initialized)
+      tcache_destroy(NULL);
+    tcache_count = value;
 
-  // Mark that block as free
-  free_block->is_free = FREE;
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned int i = 0; i < MAX_ARENAS; i++)
+    {
+      if (arenas[i] != NULL)
+        central_drain(arenas[i]);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return 1;
+  case MY_M_ARENA_MAX:
+    if (value < 0 || value > MAX_ARENAS)
+      return 0;
+    arena_max = value;
+    return 1;
+  case MY_M_MMAP_THRESHOLD:
+    if (value <= 0)
+      return 0;
+    mmap_threshold = value;
+    return 1;
+  case MY_M_SLAB_MAX:
+    if (value < 0 || value > SLAB_MAX_SIZE)
+      return 0;
+    slab_max = value;
+    return 1;
+  case MY_M_PURGE_DECAY:
+    if (value < -1)
+      return 0;
+    purge_decay_ms = value;
+    return 1;
+  case MY_M_PROFILE_RATE:
+    if (value < 0)
+      return 0;
+    // The first backtrace() loads the unwinder,
+    // which is better done now than inside the
+    // first sample
+    if (value > 0)
+    {
+      void *frame;
+      backtrace(&frame, 1);
+    }
+    __atomic_store_n(&profile_rate, value, __ATOMIC_RELAXED);
 
-  // Attempt to coalesce. AKA, combine neighboring
-  // blocks that are all free so as to lessen the
-  // extent of external fragmentation.
-  Block *after_coalesce = coalesce(free_block);
+    // Other threads notice within
+    // PROFILE_IDLE_BYTES, this one right away
+    profile_countdown = value > 0 ? profile_interval() : 0;
+    return 1;
+  case MY_M_TRIM_THRESHOLD:
+    if (value < 0)
+      return 0;
+    trim_threshold = value;
+    return 1;
+  case MY_M_TOP_PAD:
+    if (value < 0)
+      return 0;
+    top_pad = value;
+    return 1;
+  case MY_M_HEAP_CHUNK:
+    if (value < 0)
+      return 0;
+    lock_arena(&main_arena);
+    heap_chunk_min = ALIGN_UP(value, SIZE_MULTIPLE);
+    heap_chunk = heap_chunk_min;
+    pthread_mutex_unlock(&main_arena.lock);
+    return 1;
+  case MY_M_HUGE_PAGES:
+    if (value != 0 && value != 1)
+      return 0;
+    huge_pages = value;
+    return 1;
+  case MY_M_NUMA_ARENAS:
+    if (value != 0 && value != 1)
+      return 0;
+    numa_arenas = value;
+    return 1;
+  case MY_M_CHECK_FREE_SIZE:
+    if (value != 0 && value != 1)
+      return 0;
+    check_free_size = value;
+    return 1;
+  }
+  return 0;
+}
 
-  // After coalescing, the remaining block might
-  // be our tail. If that is the case, we can
-  // signal to the OS that it can take back some
-  // of our heap memory.
-  if (after_coalesce == tail)
+/**
+ * Start recording every call to the malloc
+ * family in a trace file, replacing any trace
+ * already being recorded. Memory allocated
+ * before tracing started shows up only when it
+ * is freed or reallocated.
+ *
+ * @param path the file to write the trace to,
+ * created or truncated
+ * @return 0 on success, -1 if the file could not
+ * be created
+ */
+int my_malloc_trace_start(const char *path)
+{
+  my_malloc_trace_stop();
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  my_trace_header_t header = {MY_TRACE_MAGIC, 1, sizeof(my_trace_record_t)};
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+  {
+    close(fd);
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&trace_lock);
+  trace_start_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  trace_count = 0;
+  __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+/**
+ * Stop tracing, writing out whatever is still
+ * buffered and closing the trace file.
+ */
+void my_malloc_trace_stop()
+{
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0)
+  {
+    trace_flush();
+    close(trace_fd);
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Write the live samples of the heap profiler to
+ * a file in the legacy heap profile format of
+ * gperftools, which pprof reads. Each sample is
+ * one line with its requested size and its stack,
+ * the header carries the sampling rate so pprof
+ * can scale the samples back up to an estimate of
+ * the whole heap, and /proc/self/maps follows so
+ * addresses can be symbolized.
+ *
+ * @param path the file to write, created or
+ * truncated
+ * @return 0 on success, -1 if the file could not
+ * be written
+ */
+int my_malloc_profile_dump(const char *path)
+{
+  char line[64 + PROFILE_MAX_DEPTH * 20];
+  size_t count = 0;
+  size_t bytes = 0;
+  int failed = 0;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&profile_lock);
+  for (unsigned int i = 0; i < PROFILE_BUCKETS; i++)
+  {
+    for (Sample *sample = profile_table[i]; sample != NULL;
+         sample = sample->next)
+    {
+      count++;
+      bytes += sample->size;
+    }
+  }
+
+  size_t rate = profile_rate != 0 ? profile_rate : 1;
+  int length = snprintf(line, sizeof(line),
+                        "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                        count, bytes, count, bytes, rate);
+  failed |= write_all(fd, line, length);
+
+  for (unsigned int i = 0; i < PROFILE_BUCKETS; i++)
+  {
+    for (Sample *sample = profile_table[i]; sample != NULL;
+         sample = sample->next)
+    {
+      length = snprintf(line, sizeof(line), "%6d: %8zu [%6d: %8zu] @", 1,
+                        sample->size, 1, sample->size);
+      for (unsigned int j = 0; j < sample->depth; j++)
+      {
+        length += snprintf(line + length, sizeof(line) - length, " %p",
+                           sample->stack[j]);
+      }
+      line[length++] = '\n';
+      failed |= write_all(fd, line, length);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  const char *maps_header = "\nMAPPED_LIBRARIES:\n";
+  failed |= write_all(fd, maps_header, strlen(maps_header));
+
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0)
+  {
+    ssize_t got;
+    while ((got = read(maps, line, sizeof(line))) > 0)
+    {
+      failed |= write_all(fd, line, got);
+    }
+    close(maps);
+  }
+
+  if (close(fd) != 0)
+    failed = -1;
+  return failed;
+}
+
+/**
+ * Take every lock of the allocator so that no
+ * other thread is halfway through changing a
+ * heap when the process forks. Meant to be
+ * registered with pthread_atfork() together with
+ * my_malloc_postfork_parent() and
+ * my_malloc_postfork_child(). Private arenas are
+ * not covered: they must not be in use by another
+ * thread across a fork().
+ */
+void my_malloc_prefork()
+{
+  // arenas_lock first, so no arena is added while
+  // we go through the list
+  pthread_mutex_lock(&arenas_lock);
+  for (unsigned int i = 0; i < MAX_ARENAS; i++)
+  {
+    if (arenas[i] == NULL)
+      continue;
+
+    for (unsigned int j = 0; j < NUM_TCACHE_BINS; j++)
+    {
+      pthread_mutex_lock(&arenas[i]->central[j].lock);
+    }
+    pthread_mutex_lock(&arenas[i]->lock);
+  }
+  pthread_mutex_lock(&region_map_lock);
+  pthread_mutex_lock(&trace_lock);
+  pthread_mutex_lock(&profile_lock);
+}
+
+/**
+ * Release the locks taken by my_malloc_prefork()
+ * in the parent once fork() returns.
+ */
+void my_malloc_postfork_parent()
+{
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&trace_lock);
+  pthread_mutex_unlock(&region_map_lock);
+  for (unsigned int i = 0; i < MAX_ARENAS; i++)
+  {
+    if (arenas[i] == NULL)
+      continue;
+
+    pthread_mutex_unlock(&arenas[i]->lock);
+    for (unsigned int j = 0; j < NUM_TCACHE_BINS; j++)
+    {
+      pthread_mutex_unlock(&arenas[i]->central[j].lock);
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+/**
+ * Reset the locks taken by my_malloc_prefork() in
+ * the child, where the only thread left is the
+ * one that called fork(). Blocks cached by the
+ * other threads of the parent are lost. The
+ * child does not inherit the parent's trace:
+ * records still buffered are the parent's to
+ * write.
+ */
+void my_malloc_postfork_child()
+{
+  if (trace_fd >= 0)
+  {
+    close(trace_fd);
+    trace_fd = -1;
+    trace_count = 0;
+  }
+  pthread_mutex_init(&profile_lock, NULL);
+  pthread_mutex_init(&trace_lock, NULL);
+  pthread_mutex_init(&region_map_lock, NULL);
+  for (unsigned int i = 0; i < MAX_ARENAS; i++)
+  {
+    if (arenas[i] == NULL)
+      continue;
+
+    pthread_mutex_init(&arenas[i]->lock, NULL);
+    for (unsigned int j = 0; j < NUM_TCACHE_BINS; j++)
+    {
+      pthread_mutex_init(&arenas[i]->central[j].lock, NULL);
+    }
+  }
+  pthread_mutex_init(&arenas_lock, NULL);
+}
+
+/**
+ * Add up how often the locks of the shared
+ * arenas were taken and how often a thread had to
+ * wait for one, to see where threads contend.
+ * Private arenas are not counted.
+ *
+ * @param stats where to store the totals
+ */
+void my_malloc_lock_stats(my_lock_stats_t *stats)
+{
+  stats->arena_acquired = 0;
+  stats->arena_contended = 0;
+  stats->bin_acquired = 0;
+  stats->bin_contended = 0;
+
+  pthread_mutex_lock(&arenas_lock);
+  for (unsigned int i = 0; i < MAX_ARENAS; i++)
+  {
+    Arena *arena = arenas[i];
+    if (arena == NULL)
+      continue;
+
+    pthread_mutex_lock(&arena->lock);
+    stats->arena_acquired += arena->lock_stats.acquired;
+    stats->arena_contended += arena->lock_stats.contended;
+    pthread_mutex_unlock(&arena->lock);
+
+    for (unsigned int j = 0; j < NUM_TCACHE_BINS; j++)
+    {
+      CentralBin *bin = &arena->central[j];
+      pthread_mutex_lock(&bin->lock);
+      stats->bin_acquired += bin->lock_stats.acquired;
+      stats->bin_contended += bin->lock_stats.contended;
+      pthread_mutex_unlock(&bin->lock);
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+/**
+ * Add up the statistics of the shared arenas and
+ * of the blocks mapped separately. Only counters
+ * are read, apart from looking up the largest
+ * free block of each arena, so the cost does not
+ * grow with the number of blocks. Private arenas
+ * are not counted.
+ *
+ * @param stats where to store the totals
+ */
+void my_malloc_stats(my_malloc_stats_t *stats)
+{
+  size_t slab_object_bytes = 0;
+
+  memset(stats, 0, sizeof(*stats));
+
+  pthread_mutex_lock(&arenas_lock);
+  for (unsigned int i = 0; i < MAX_ARENAS; i++)
+  {
+    Arena *arena = arenas[i];
+    if (arena == NULL)
+      continue;
+
+    pthread_mutex_lock(&arena->lock);
+    ArenaStats *counts = &arena->stats;
+    stats->heap_bytes += counts->block_bytes + counts->blocks * sizeof(Block);
+    stats->allocated_bytes += counts->block_bytes - counts->free_bytes;
+    stats->allocated_blocks += counts->blocks - counts->free_blocks;
+    stats->free_bytes += counts->free_bytes;
+    stats->free_blocks += counts->free_blocks;
+    stats->purged_bytes += counts->purged_bytes;
+    stats->slab_bytes += counts->slab_pages * SLAB_SIZE;
+    stats->slab_objects += counts->slab_objects;
+    stats->overhead_bytes += counts->blocks * sizeof(Block);
+    slab_object_bytes += counts->slab_object_bytes;
+
+    for (unsigned int j = 0; j < MY_STATS_CLASSES; j++)
+    {
+      stats->allocated_by_class[j] += counts->blocks_by_class[j] -
+                                      counts->free_by_class[j] +
+                                      counts->slab_objects_by_class[j];
+      stats->free_by_class[j] += counts->free_by_class[j];
+    }
+
+    size_t largest = largest_free_block(arena);
+    if (largest > stats->largest_free_block)
+      stats->largest_free_block = largest;
+    pthread_mutex_unlock(&arena->lock);
+  }
+  pthread_mutex_unlock(&arenas_lock);
+
+  stats->mapped_blocks = __atomic_load_n(&mapped_blocks, __ATOMIC_RELAXED);
+  stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  size_t mapped_data_bytes = __atomic_load_n(&mapped_data, __ATOMIC_RELAXED);
+
+  // Mappings count as allocated blocks, and
+  // whatever of their pages the data does not use
+  // as overhead
+  for (unsigned int j = 0; j < MY_STATS_CLASSES; j++)
   {
-    remove_from_list(after_coalesce);
-    contract_heap(after_coalesce);
+    stats->allocated_by_class[j] +=
+        __atomic_load_n(&mapped_by_class[j], __ATOMIC_RELAXED);
   }
+  stats->allocated_bytes += slab_object_bytes + mapped_data_bytes;
+  stats->allocated_blocks += stats->slab_objects + stats->mapped_blocks;
+  stats->overhead_bytes += stats->slab_bytes - slab_object_bytes;
+  stats->overhead_bytes += stats->mapped_bytes - mapped_data_bytes;
+
+  if (stats->free_bytes > 0)
+    stats->fragmentation =
+        1.0 - (double)stats->largest_free_block / stats->free_bytes;
 }
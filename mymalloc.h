@@ -2,7 +2,144 @@
 #ifndef _MYMALLOC_H_
 #define _MYMALLOC_H_
 
-void* my_malloc(unsigned int size);
+#include <stddef.h>
+#include <stdint.h>
+
+// Parameters for my_mallopt()
+#define MY_M_TCACHE_COUNT 1
+#define MY_M_ARENA_MAX 2
+#define MY_M_MMAP_THRESHOLD 3
+#define MY_M_SLAB_MAX 4
+#define MY_M_PROFILE_RATE 5
+#define MY_M_PURGE_DECAY 6
+#define MY_M_TRIM_THRESHOLD 7
+#define MY_M_TOP_PAD 8
+#define MY_M_HEAP_CHUNK 9
+#define MY_M_HUGE_PAGES 10
+#define MY_M_NUMA_ARENAS 11
+#define MY_M_CHECK_FREE_SIZE 12
+
+// An independent heap that can be released in one go
+typedef struct Arena my_arena_t;
+
+// Filled in by my_malloc_lock_stats(). "bin" counts the locks of the
+// central bins between the thread caches and the arenas.
+typedef struct {
+  unsigned long arena_acquired;
+  unsigned long arena_contended;
+  unsigned long bin_acquired;
+  unsigned long bin_contended;
+} my_lock_stats_t;
+
+// Size classes of my_malloc_stats_t. Class i counts blocks whose data size
+// is in [16 << i, 32 << i); the last class also counts everything bigger.
+#define MY_STATS_CLASSES 24
+
+// Filled in by my_malloc_stats() from counters the allocator keeps as it
+// goes, so it is cheap enough to poll. Covers the shared arenas and memory
+// mapped separately; private arenas are not counted. Memory waiting in a
+// thread cache, a central bin or another thread's remote free queue counts
+// as allocated. Sizes are in bytes.
+typedef struct {
+  size_t heap_bytes;       // every block carved from an arena, with headers
+  size_t allocated_bytes;  // data of blocks, slab objects and mappings in use
+  size_t allocated_blocks;
+  size_t free_bytes;  // data of the free blocks the arenas hold on to
+  size_t free_blocks;
+  size_t purged_bytes;  // pages of free blocks given back to the OS
+  size_t mapped_bytes;  // mappings of big blocks, whole pages
+  size_t mapped_blocks;
+  size_t slab_bytes;  // slab pages holding objects
+  size_t slab_objects;
+  size_t overhead_bytes;  // block headers, and slab space no object uses
+  size_t largest_free_block;
+  // 1 - largest_free_block / free_bytes: 0 when all free memory is in one
+  // block, close to 1 when it is scattered over many small ones
+  double fragmentation;
+  size_t allocated_by_class[MY_STATS_CLASSES];  // blocks and slab objects
+  size_t free_by_class[MY_STATS_CLASSES];
+} my_malloc_stats_t;
+
+void* my_malloc(size_t size);
 void my_free(void* ptr);
+void* my_calloc(size_t count, size_t size);
+void* my_realloc(void* ptr, size_t size);
+void* my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void** memptr, size_t alignment, size_t size);
+size_t my_malloc_usable_size(void* ptr);
+
+// Allocate count objects of size bytes into ptrs, taking the arena lock once
+// and carving larger objects side by side from a few big blocks. Returns how
+// many were allocated, fewer than count only if memory ran out.
+size_t my_malloc_batch(size_t size, size_t count, void** ptrs);
+// Free count objects from any allocation function, NULLs allowed. Objects
+// listed in address order that sit next to each other, as a batch's do, are
+// merged before they go back to their arena.
+void my_free_batch(void** ptrs, size_t count);
+// Free memory allocated, or last reallocated, with size bytes. The size
+// stands in for reading the memory's header; MY_M_CHECK_FREE_SIZE checks it.
+void my_free_sized(void* ptr, size_t size);
+int my_mallopt(int param, int value);
+void my_malloc_lock_stats(my_lock_stats_t* stats);
+void my_malloc_stats(my_malloc_stats_t* stats);
+
+// Record every call to the malloc family to a file, for replay.c to
+// re-execute later. Returns 0 on success, -1 if the file cannot be created.
+int my_malloc_trace_start(const char* path);
+void my_malloc_trace_stop();
+
+// Write the allocations sampled by the heap profiler (see
+// MY_M_PROFILE_RATE) that are still live to a file pprof can read:
+//
+//   pprof --text program file
+//
+// Returns 0 on success, -1 if the file cannot be written.
+int my_malloc_profile_dump(const char* path);
+
+my_arena_t* my_arena_create();
+void* my_arena_malloc(my_arena_t* arena, size_t size);
+void my_arena_destroy(my_arena_t* arena);
+
+// Keep the heaps consistent across fork(). Register them with
+// pthread_atfork(my_malloc_prefork, my_malloc_postfork_parent,
+//                my_malloc_postfork_child).
+void my_malloc_prefork();
+void my_malloc_postfork_parent();
+void my_malloc_postfork_child();
+
+// A trace file is a my_trace_header_t followed by my_trace_record_t's in the
+// order the calls took effect. Pointers double as ids: an address is only
+// reused after the record freeing it.
+#define MY_TRACE_MAGIC "MYTRACE1"
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} my_trace_header_t;
+
+enum {
+  MY_TRACE_MALLOC = 1,
+  MY_TRACE_CALLOC,
+  // alignment_shift holds log2 of the alignment
+  MY_TRACE_ALIGNED,
+  // Written before the call with the old pointer and the new size, and
+  // followed by a MY_TRACE_REALLOC_RESULT from the same thread with the
+  // pointer returned
+  MY_TRACE_REALLOC,
+  MY_TRACE_REALLOC_RESULT,
+  // Written before the memory is released
+  MY_TRACE_FREE,
+};
+
+typedef struct {
+  uint64_t timestamp;  // nanoseconds since tracing started
+  uint64_t ptr;
+  uint64_t size;
+  uint32_t thread;  // numbered from 1 in order of their first call
+  uint8_t op;
+  uint8_t alignment_shift;
+  uint16_t reserved;
+} my_trace_record_t;
 
 #endif
@@ -0,0 +1,369 @@
+// Re-executes an allocation trace recorded with my_malloc_trace_start(), or
+// with MYMALLOC_TRACE=file under libmymalloc.so, against my_malloc and the
+// system malloc:
+//
+//   ./replay trace [my_malloc|system]
+//
+// The trace is first compiled into a list of operations on dense slots, one
+// per live allocation, so replaying needs no lookups. Each allocator then
+// replays it single-threaded, in trace order, in a child process of its own.
+// Every page of every allocation is touched so the resident set reflects the
+// heap's real footprint.
+
+// aligned_alloc() is C11, which gnu99 does not declare by default
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+
+#define PAGE_SIZE 4096
+#define MAX_TRACE_THREADS 65536
+
+enum { OP_MALLOC, OP_CALLOC, OP_ALIGNED, OP_REALLOC, OP_FREE };
+
+typedef struct Op {
+  uint64_t size;
+  uint32_t slot;
+  uint8_t kind;
+  uint8_t alignment_shift;
+} Op;
+
+typedef struct Allocator {
+  const char* name;
+  void* (*malloc)(size_t size);
+  void* (*calloc)(size_t count, size_t size);
+  void* (*aligned_alloc)(size_t alignment, size_t size);
+  void* (*realloc)(void* ptr, size_t size);
+  void (*free)(void* ptr);
+} Allocator;
+
+Allocator allocators[] = {
+    {"my_malloc", my_malloc, my_calloc, my_aligned_alloc, my_realloc,
+     my_free},
+    {"system", malloc, calloc, aligned_alloc, realloc, free},
+};
+
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+// Maps the addresses live in the trace to their slots while compiling it.
+// Open addressing with linear probing; address 0 marks an empty entry.
+typedef struct Entry {
+  uint64_t ptr;
+  uint32_t slot;
+} Entry;
+
+Entry* table;
+size_t table_size = 1024;
+size_t table_used;
+
+// Slots freed in the trace, reused for later allocations so the slot
+// arrays stay as small as the peak number of live allocations
+uint32_t* free_slots;
+size_t num_free_slots;
+uint32_t num_slots;
+
+// Compiled operations, and counts of what had to be dropped
+Op* ops;
+size_t num_ops;
+size_t unmatched;
+
+size_t table_index(uint64_t ptr) {
+  return (ptr >> 4) * 0x9E3779B97F4A7C15ULL & (table_size - 1);
+}
+
+void table_insert(uint64_t ptr, uint32_t slot);
+
+void table_grow() {
+  Entry* old = table;
+  size_t old_size = table_size;
+  size_t i;
+
+  table_size *= 2;
+  table = calloc(table_size, sizeof(Entry));
+  table_used = 0;
+  for (i = 0; i < old_size; i++)
+    if (old[i].ptr != 0) table_insert(old[i].ptr, old[i].slot);
+  free(old);
+}
+
+void table_insert(uint64_t ptr, uint32_t slot) {
+  size_t i;
+
+  if (2 * (table_used + 1) > table_size) table_grow();
+
+  i = table_index(ptr);
+  while (table[i].ptr != 0 && table[i].ptr != ptr)
+    i = (i + 1) & (table_size - 1);
+  if (table[i].ptr == 0) table_used++;
+  table[i].ptr = ptr;
+  table[i].slot = slot;
+}
+
+// Removes ptr from the table. Returns its slot, or -1 if it is not there.
+long table_remove(uint64_t ptr) {
+  size_t i = table_index(ptr);
+  size_t hole, j;
+  long slot;
+
+  while (table[i].ptr != ptr) {
+    if (table[i].ptr == 0) return -1;
+    i = (i + 1) & (table_size - 1);
+  }
+  slot = table[i].slot;
+
+  // Shift later entries of the probe sequence back into the hole
+  hole = i;
+  for (j = (i + 1) & (table_size - 1); table[j].ptr != 0;
+       j = (j + 1) & (table_size - 1)) {
+    size_t home = table_index(table[j].ptr);
+    if (((j - home) & (table_size - 1)) >= ((j - hole) & (table_size - 1))) {
+      table[hole] = table[j];
+      hole = j;
+    }
+  }
+  table[hole].ptr = 0;
+  table_used--;
+  return slot;
+}
+
+uint32_t new_slot() {
+  if (num_free_slots > 0) return free_slots[--num_free_slots];
+  return num_slots++;
+}
+
+void release_slot(uint32_t slot) { free_slots[num_free_slots++] = slot; }
+
+void add_op(uint8_t kind, uint32_t slot, uint64_t size, uint8_t shift) {
+  Op* op = &ops[num_ops++];
+  op->kind = kind;
+  op->slot = slot;
+  op->size = size;
+  op->alignment_shift = shift;
+}
+
+// Turns the records into operations on slots. A realloc is compiled when its
+// result comes in; until then its slot waits in pending.
+void compile(my_trace_record_t* records, size_t count) {
+  static long pending[MAX_TRACE_THREADS];
+  size_t i;
+
+  table = calloc(table_size, sizeof(Entry));
+  free_slots = malloc(count * sizeof(uint32_t));
+  ops = malloc(count * sizeof(Op));
+
+  for (i = 0; i < count; i++) {
+    my_trace_record_t* record = &records[i];
+    uint32_t thread = record->thread % MAX_TRACE_THREADS;
+    long slot;
+
+    switch (record->op) {
+      case MY_TRACE_MALLOC:
+      case MY_TRACE_CALLOC:
+      case MY_TRACE_ALIGNED:
+        slot = new_slot();
+        table_insert(record->ptr, slot);
+        add_op(record->op == MY_TRACE_MALLOC   ? OP_MALLOC
+               : record->op == MY_TRACE_CALLOC ? OP_CALLOC
+                                               : OP_ALIGNED,
+               slot, record->size, record->alignment_shift);
+        break;
+
+      case MY_TRACE_FREE:
+        slot = table_remove(record->ptr);
+        if (slot < 0) {
+          unmatched++;
+          break;
+        }
+        add_op(OP_FREE, slot, 0, 0);
+        release_slot(slot);
+        break;
+
+      case MY_TRACE_REALLOC:
+        slot = record->ptr != 0 ? table_remove(record->ptr) : -1;
+        if (record->ptr != 0 && slot < 0) unmatched++;
+        // Growing memory the trace never saw allocated, or realloc(NULL),
+        // is replayed as a realloc of a fresh, empty slot
+        pending[thread] = slot >= 0 ? slot : -(long)new_slot() - 2;
+        break;
+
+      case MY_TRACE_REALLOC_RESULT:
+        slot = pending[thread] >= 0 ? pending[thread] : -pending[thread] - 2;
+        if (record->size == 0) {
+          // realloc(ptr, 0) frees
+          add_op(OP_FREE, slot, 0, 0);
+          release_slot(slot);
+        } else if (record->ptr == 0) {
+          // A failed realloc leaves the old memory alone, but its address
+          // is gone from the table; drop the slot from the replay too
+          unmatched++;
+        } else {
+          add_op(OP_REALLOC, slot, record->size, 0);
+          table_insert(record->ptr, slot);
+        }
+        break;
+    }
+  }
+}
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+long rss_kb() {
+  long pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+
+  if (statm != NULL) {
+    if (fscanf(statm, "%*d %ld", &pages) != 1) pages = 0;
+    fclose(statm);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void touch(char* ptr, uint64_t size) {
+  uint64_t offset;
+
+  for (offset = 0; offset < size; offset += PAGE_SIZE) ptr[offset] = 1;
+  ptr[size - 1] = 1;
+}
+
+void* map_array(size_t size) {
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  memset(memory, 0, size);
+  return memory;
+}
+
+// Replays the compiled operations and prints one result line. The slot
+// arrays are mapped and touched up front, so the growth of the resident set
+// from here on is the heap.
+void replay(Allocator* alloc) {
+  void** slots = map_array(num_slots * sizeof(void*) + 1);
+  uint64_t* sizes = map_array(num_slots * sizeof(uint64_t) + 1);
+  long baseline = rss_kb();
+  struct rusage usage;
+  uint64_t live = 0;
+  uint64_t peak_live = 0;
+  long in_allocator = 0;
+  long start = now_ns();
+  size_t i;
+
+  for (i = 0; i < num_ops; i++) {
+    Op* op = &ops[i];
+    void* ptr = NULL;
+    long before = now_ns();
+
+    switch (op->kind) {
+      case OP_MALLOC:
+        ptr = alloc->malloc(op->size);
+        break;
+      case OP_CALLOC:
+        ptr = alloc->calloc(1, op->size);
+        break;
+      case OP_ALIGNED:
+        ptr = alloc->aligned_alloc((size_t)1 << op->alignment_shift,
+                                   op->size);
+        break;
+      case OP_REALLOC:
+        ptr = alloc->realloc(slots[op->slot], op->size);
+        break;
+      case OP_FREE:
+        alloc->free(slots[op->slot]);
+        break;
+    }
+    in_allocator += now_ns() - before;
+
+    live -= sizes[op->slot];
+    if (op->kind == OP_FREE) {
+      slots[op->slot] = NULL;
+      sizes[op->slot] = 0;
+    } else {
+      if (ptr == NULL) {
+        fprintf(stderr, "%s: allocation of %lu bytes failed\n", alloc->name,
+                (unsigned long)op->size);
+        exit(1);
+      }
+      touch(ptr, op->size);
+      slots[op->slot] = ptr;
+      sizes[op->slot] = op->size;
+      live += op->size;
+    }
+
+    if (live > peak_live) peak_live = live;
+  }
+
+  // The child's high-water mark started out no higher than baseline
+  double seconds = (now_ns() - start) / 1e9;
+  getrusage(RUSAGE_SELF, &usage);
+  long heap_kb = usage.ru_maxrss - baseline;
+  long live_kb = peak_live / 1024;
+
+  // Fragmentation: how much more memory the heap held at its peak than the
+  // program had live at its own peak
+  printf("%-10s %8.3f s total  %8.3f s in allocator  peak live %9ld KB"
+         "  peak heap RSS %9ld KB  fragmentation %6.1f%%\n",
+         alloc->name, seconds, in_allocator / 1e9, live_kb, heap_kb,
+         live_kb > 0 ? 100.0 * (heap_kb - live_kb) / live_kb : 0.0);
+}
+
+int main(int argc, char** argv) {
+  struct stat info;
+  my_trace_header_t* header;
+  int fd, i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [my_malloc|system]\n", argv[0]);
+    return 2;
+  }
+
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &info) != 0 ||
+      (size_t)info.st_size < sizeof(my_trace_header_t)) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 1;
+  }
+
+  header = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (header == MAP_FAILED ||
+      memcmp(header->magic, MY_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(my_trace_record_t)) {
+    fprintf(stderr, "%s is not a trace this replay understands\n", argv[1]);
+    return 1;
+  }
+
+  size_t count = (info.st_size - sizeof(my_trace_header_t)) /
+                 sizeof(my_trace_record_t);
+  compile((my_trace_record_t*)(header + 1), count);
+  munmap(header, info.st_size);
+  free(table);
+  free(free_slots);
+
+  printf("# %s: %zu records, %zu operations, %u slots, %zu unmatched\n",
+         argv[1], count, num_ops, num_slots, unmatched);
+  fflush(stdout);
+
+  for (i = 0; i < NUM_ALLOCATORS; i++) {
+    if (argc > 2 && strcmp(argv[2], allocators[i].name) != 0) continue;
+
+    pid_t child = fork();
+    if (child == 0) {
+      replay(&allocators[i]);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(child, NULL, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,306 @@
+/**
+ * Author: Joshua Sizer
+ *
+ * Exports the standard malloc family on top of
+ * my_malloc, so the allocator can stand in for
+ * the system one in unmodified programs:
+ *
+ *   LD_PRELOAD=./libmymalloc.so some_program
+ *
+ * The library is built with hidden visibility,
+ * so only the functions below are exported and
+ * the allocator's own helpers cannot clash with
+ * symbols of the program.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+// Requests made while the allocator is already
+// running on the same thread, e.g. by stdio while
+// it reports an error, cannot go back into it
+// without deadlocking on an arena lock. They are
+// served from this buffer instead and never
+// freed. Every allocation starts with a
+// BOOTSTRAP_HEADER holding its size.
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define BOOTSTRAP_HEADER 16
+
+char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+size_t bootstrap_used = 0;
+
+// Set while the calling thread is inside the
+// allocator
+__thread int busy;
+
+/**
+ * Allocate from the bootstrap buffer.
+ *
+ * @param size the number of bytes to allocate
+ * @return 16 byte aligned memory, or NULL if the
+ * buffer is used up
+ */
+void *bootstrap_malloc(size_t size)
+{
+  size_t needed = (BOOTSTRAP_HEADER + size + 15) & ~(size_t)15;
+  if (size > BOOTSTRAP_SIZE)
+    return NULL;
+
+  size_t offset =
+      __atomic_fetch_add(&bootstrap_used, needed, __ATOMIC_RELAXED);
+  if (offset + needed > BOOTSTRAP_SIZE)
+    return NULL;
+
+  *(size_t *)(bootstrap + offset) = size;
+  return bootstrap + offset + BOOTSTRAP_HEADER;
+}
+
+/**
+ * Check whether a pointer came from the bootstrap
+ * buffer.
+ *
+ * @param ptr any pointer
+ */
+int is_bootstrap(void *ptr)
+{
+  return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/**
+ * Get the size of a bootstrap allocation.
+ *
+ * @param ptr memory from bootstrap_malloc()
+ */
+size_t bootstrap_size(void *ptr)
+{
+  return *(size_t *)((char *)ptr - BOOTSTRAP_HEADER);
+}
+
+// Sampling rate of the heap profiler when
+// MYMALLOC_PROFILE is set but
+// MYMALLOC_PROFILE_RATE is not
+#define DEFAULT_PROFILE_RATE (512 * 1024)
+
+const char *profile_path;
+
+/**
+ * Write the heap profile on the way out.
+ */
+void shim_profile_dump() { my_malloc_profile_dump(profile_path); }
+
+/**
+ * Register the fork handlers before main() runs,
+ * start tracing to the file named by
+ * MYMALLOC_TRACE if it is set, and start the heap
+ * profiler if MYMALLOC_PROFILE names the file to
+ * write the profile to at exit. MYMALLOC_HUGE_PAGES=1
+ * turns on huge pages for the memory mapped from
+ * then on. Nothing else needs
+ * setting up: the allocator is usable from the
+ * very first call, which may come from the
+ * dynamic loader before any constructor has run.
+ */
+__attribute__((constructor)) void shim_init()
+{
+  pthread_atfork(my_malloc_prefork, my_malloc_postfork_parent,
+                 my_malloc_postfork_child);
+
+  const char *trace_path = getenv("MYMALLOC_TRACE");
+  if (trace_path != NULL && my_malloc_trace_start(trace_path) == 0)
+    atexit(my_malloc_trace_stop);
+
+  profile_path = getenv("MYMALLOC_PROFILE");
+  if (profile_path != NULL)
+  {
+    const char *rate = getenv("MYMALLOC_PROFILE_RATE");
+    my_mallopt(MY_M_PROFILE_RATE,
+               rate != NULL ? atoi(rate) : DEFAULT_PROFILE_RATE);
+    atexit(shim_profile_dump);
+  }
+
+  const char *huge_pages = getenv("MYMALLOC_HUGE_PAGES");
+  if (huge_pages != NULL)
+    my_mallopt(MY_M_HUGE_PAGES, atoi(huge_pages));
+}
+
+/**
+ * Replaces malloc(). Unlike my_malloc(), a size
+ * of 0 still gets a unique pointer, which is
+ * what programs written against glibc expect.
+ */
+EXPORT void *malloc(size_t size)
+{
+  if (busy)
+    return bootstrap_malloc(size);
+
+  busy = 1;
+  void *ptr = my_malloc(size != 0 ? size : 1);
+  busy = 0;
+
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+/**
+ * Replaces free(). Bootstrap allocations are
+ * never freed.
+ */
+EXPORT void free(void *ptr)
+{
+  if (ptr == NULL || is_bootstrap(ptr))
+    return;
+
+  busy = 1;
+  my_free(ptr);
+  busy = 0;
+}
+
+/**
+ * Replaces free_sized() from C23.
+ */
+EXPORT void free_sized(void *ptr, size_t size)
+{
+  if (ptr == NULL || is_bootstrap(ptr))
+    return;
+
+  busy = 1;
+  my_free_sized(ptr, size);
+  busy = 0;
+}
+
+/**
+ * Replaces calloc().
+ */
+EXPORT void *calloc(size_t count, size_t size)
+{
+  if (size != 0 && count > SIZE_MAX / size)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (busy)
+  {
+    // The bootstrap buffer starts out zeroed and
+    // is never reused
+    return bootstrap_malloc(count * size);
+  }
+
+  busy = 1;
+  void *ptr = count * size != 0 ? my_calloc(count, size) : my_malloc(1);
+  busy = 0;
+
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+/**
+ * Replaces realloc(). Bootstrap allocations are
+ * copied into the allocator proper.
+ */
+EXPORT void *realloc(void *ptr, size_t size)
+{
+  if (ptr != NULL && is_bootstrap(ptr))
+  {
+    // Move it out of the bootstrap buffer
+    void *new_ptr = malloc(size);
+    if (new_ptr != NULL)
+    {
+      size_t old_size = bootstrap_size(ptr);
+      memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    }
+    return new_ptr;
+  }
+
+  if (busy)
+    return ptr == NULL ? bootstrap_malloc(size) : NULL;
+
+  busy = 1;
+  void *new_ptr = my_realloc(ptr, size);
+  busy = 0;
+
+  if (new_ptr == NULL && size != 0)
+    errno = ENOMEM;
+  return new_ptr;
+}
+
+/**
+ * Replaces aligned_alloc().
+ */
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (busy)
+    return alignment <= 16 ? bootstrap_malloc(size) : NULL;
+
+  busy = 1;
+  void *ptr = my_aligned_alloc(alignment, size != 0 ? size : 1);
+  busy = 0;
+
+  if (ptr == NULL)
+    errno = alignment != 0 && (alignment & (alignment - 1)) == 0 ? ENOMEM
+                                                                 : EINVAL;
+  return ptr;
+}
+
+/**
+ * Replaces the obsolete memalign().
+ */
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+  return aligned_alloc(alignment, size);
+}
+
+/**
+ * Replaces posix_memalign().
+ */
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (busy)
+    return ENOMEM;
+
+  busy = 1;
+  int result = my_posix_memalign(memptr, alignment, size != 0 ? size : 1);
+  busy = 0;
+  return result;
+}
+
+/**
+ * Replaces the obsolete valloc(): page aligned
+ * memory.
+ */
+EXPORT void *valloc(size_t size)
+{
+  return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+/**
+ * Replaces the obsolete pvalloc(): page aligned
+ * memory, rounded up to whole pages.
+ */
+EXPORT void *pvalloc(size_t size)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+/**
+ * Replaces malloc_usable_size().
+ */
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+  if (ptr != NULL && is_bootstrap(ptr))
+    return bootstrap_size(ptr);
+
+  return my_malloc_usable_size(ptr);
+}
@@ -0,0 +1,165 @@
+// Measures the worst-case latency of my_malloc and my_free, to compare the
+// default bins with TLSF mode. `make tlsfbench` builds both:
+//
+//   ./tlsfbench_bins    free blocks in bins and a best-fit tree
+//   ./tlsfbench_tlsf    free blocks in TLSF lists (-DMYMALLOC_TLSF)
+//
+// The thread cache and slabs are turned off and nothing is mapped
+// separately, so every call goes through the arena's free block index.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mymalloc.h"
+
+#define NUM_SLOTS 20000
+#define NUM_OPS 1000000
+#define MAX_SIZE (64 * 1024)
+
+// Free blocks parked for the adversarial case, of PARKED_SIZES distinct
+// sizes from TREE_SIZE up
+#define NUM_PARKED 20000
+#define PARKED_SIZES 512
+#define TREE_SIZE 1024
+
+#ifdef MYMALLOC_TLSF
+#define MODE "tlsf"
+#else
+#define MODE "bins"
+#endif
+
+typedef struct Latencies {
+  long* samples;
+  int count;
+} Latencies;
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+unsigned int next_random(unsigned int* state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+// Sizes spread evenly over the powers of two from 16 bytes to MAX_SIZE, so
+// small and large free blocks get mixed on the heap.
+size_t random_size(unsigned int* state) {
+  int shift = 4 + next_random(state) % 12;
+  size_t size = (size_t)1 << shift;
+  return size + next_random(state) % size;
+}
+
+int compare_longs(const void* a, const void* b) {
+  long x = *(const long*)a;
+  long y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+void report(const char* what, Latencies* latencies) {
+  long* samples = latencies->samples;
+  int count = latencies->count;
+
+  qsort(samples, count, sizeof(long), compare_longs);
+  printf("%-6s %-24s %8d ops  p50 %6ld ns  p99 %6ld ns  p99.9 %7ld ns"
+         "  max %8ld ns\n",
+         MODE, what, count, samples[count / 2], samples[count * 99L / 100],
+         samples[count * 999L / 1000], samples[count - 1]);
+}
+
+// Random mallocs and frees of mixed sizes over a heap that is kept
+// fragmented by holding on to about half of the slots.
+void bench_random() {
+  static void* slots[NUM_SLOTS];
+  Latencies mallocs = {malloc(NUM_OPS * sizeof(long)), 0};
+  Latencies frees = {malloc(NUM_OPS * sizeof(long)), 0};
+  unsigned int state = 1;
+  int i;
+
+  for (i = 0; i < NUM_OPS; i++) {
+    int slot = next_random(&state) % NUM_SLOTS;
+    long start;
+
+    if (slots[slot] == NULL) {
+      size_t size = random_size(&state);
+      start = now_ns();
+      slots[slot] = my_malloc(size);
+      mallocs.samples[mallocs.count++] = now_ns() - start;
+    } else {
+      start = now_ns();
+      my_free(slots[slot]);
+      frees.samples[frees.count++] = now_ns() - start;
+      slots[slot] = NULL;
+    }
+  }
+
+  report("malloc (random)", &mallocs);
+  report("free (random)", &frees);
+
+  for (i = 0; i < NUM_SLOTS; i++) my_free(slots[i]);
+  free(mallocs.samples);
+  free(frees.samples);
+}
+
+// The worst case for the default build: the best-fit tree, which holds the
+// free blocks of 1KB and up. Many free blocks of distinct sizes, kept apart
+// by guards so they never coalesce, make it deep, and each request searches
+// it, takes a block out and puts the rest of the block back. TLSF finds a
+// list that fits with two bitmap lookups however many blocks there are.
+//
+// The parked blocks are touched up front and the requests only go up to half
+// their sizes, so no request grows the heap or faults in a page, and what is
+// left to measure is the index.
+size_t parked_size(unsigned int* state, int range) {
+  return TREE_SIZE + 16 * (next_random(state) % range);
+}
+
+void bench_adversarial() {
+  static void* parked[NUM_PARKED];
+  static void* guards[NUM_PARKED];
+  static void* taken[NUM_PARKED];
+  Latencies mallocs = {malloc(NUM_PARKED * sizeof(long)), 0};
+  Latencies frees = {malloc(NUM_PARKED * sizeof(long)), 0};
+  unsigned int state = 2;
+  int i;
+
+  for (i = 0; i < NUM_PARKED; i++) {
+    size_t size = parked_size(&state, PARKED_SIZES);
+    parked[i] = my_malloc(size);
+    memset(parked[i], 1, size);
+    guards[i] = my_malloc(16);
+  }
+  for (i = 0; i < NUM_PARKED; i++) my_free(parked[i]);
+
+  for (i = 0; i < NUM_PARKED; i++) {
+    size_t size = parked_size(&state, PARKED_SIZES / 2);
+    long start = now_ns();
+    taken[i] = my_malloc(size);
+    mallocs.samples[mallocs.count++] = now_ns() - start;
+  }
+  for (i = 0; i < NUM_PARKED; i++) {
+    long start = now_ns();
+    my_free(taken[i]);
+    frees.samples[frees.count++] = now_ns() - start;
+  }
+
+  report("malloc (adversarial)", &mallocs);
+  report("free (adversarial)", &frees);
+
+  for (i = 0; i < NUM_PARKED; i++) my_free(guards[i]);
+  free(mallocs.samples);
+  free(frees.samples);
+}
+
+int main() {
+  my_mallopt(MY_M_TCACHE_COUNT, 0);
+  my_mallopt(MY_M_SLAB_MAX, 0);
+  my_mallopt(MY_M_MMAP_THRESHOLD, 1 << 30);
+
+  bench_random();
+  bench_adversarial();
+  return 0;
+}